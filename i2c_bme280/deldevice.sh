@@ -1,3 +1,7 @@
 #!/bin/bash
 
-sudo bash -c 'echo 0x76 > /sys/bus/i2c/devices/i2c-1/delete_device'
\ No newline at end of file
+# usage: deldevice.sh [bus] [address]   (default: i2c-1 0x76)
+BUS=${1:-1}
+ADDR=${2:-0x76}
+
+sudo bash -c "echo ${ADDR} > /sys/bus/i2c/devices/i2c-${BUS}/delete_device"
@@ -7,6 +7,33 @@
 #include <linux/sched.h>
 #include <linux/device.h>
 #include <linux/i2c.h>
+#include <linux/idr.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/delay.h>
+#include <linux/seqlock.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#if IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER)
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+// IIOサブシステムが使えるカーネルではIIOデバイスとしても登録する
+#define I2C_BME280_USE_IIO
+#endif
 #include <asm/current.h>
 #include <asm/uaccess.h>
 
@@ -20,6 +47,9 @@ typedef s32 int32_t;
 typedef u32 uint32_t;
 #include "i2c_bme280.h"
 
+#define CREATE_TRACE_POINTS
+#include "i2c_bme280_trace.h"
+
 
 
 // 
@@ -31,42 +61,251 @@ typedef u32 uint32_t;
 // Minor number using this device driver
 static const unsigned int MINOR_BASE = 0;
 // Minor number counts using this device driver
-static const unsigned int I2C_BANK  = 1;
+// 1モジュールで同時に扱えるBME280の最大数。probe毎に1つずつ割り当てる
+static const unsigned int I2C_BANK  = 32;
+
+// open 中のファイル毎のサンプルバッファに保持できるレコード数(2のべき乗であること)
+#define I2C_BME280_FIFO_DEPTH   64
+
+// forced mode で最大測定時間を過ぎても測定中だった場合に status を確認し直す回数
+#define I2C_BME280_MEASURING_RETRY  4
+
+// バスエラー再試行の待ち時間の上限 [us]
+#define I2C_BME280_RETRY_DELAY_MAX_US   20000
+
+// soft reset(0xE0 に 0xB6 を書く)後、NVMの読み込み(status im_update)完了を確認する回数
+#define I2C_BME280_RESET_POLL       10
+
+// 性能カウンタ
+enum
+{
+    I2C_BME280_STAT_SAMPLES,        // ioctl/read()/IIO で返したサンプル数
+    I2C_BME280_STAT_TRANSACTIONS,   // I2Cトランザクション数
+    I2C_BME280_STAT_BYTES,          // 転送したバイト数(レジスタアドレスを除く)
+    I2C_BME280_STAT_ERRORS,         // 失敗したトランザクション数
+    I2C_BME280_STAT_RETRIES,        // バスエラーでの再試行と、測定完了待ちで status を読み直した回数
+    I2C_BME280_STAT_CACHE_HITS,     // 最新サンプルのキャッシュから返した回数
+    I2C_BME280_STAT_CACHE_MISSES,   // キャッシュが古くて測定した回数
+    I2C_BME280_STAT_RESETS,         // エラーからの復旧でソフトリセットした回数
+    I2C_BME280_STAT_NUM
+};
+
+// 処理時間のヒストグラム
+// バケット n には 2^(n-1) <= t < 2^n [us] の回数を数える(バケット 0 は 1us 未満)
+enum
+{
+    I2C_BME280_HIST_BUS,            // 連続レジスタ読み出し1回
+    I2C_BME280_HIST_IOCTL,          // ioctl 1回
+    I2C_BME280_HIST_NUM
+};
+#define I2C_BME280_HIST_BUCKETS     24
+
+// CPU毎に持つ性能カウンタ。更新側は自CPUの分を加算するだけなのでロックもアトミック命令も使わない
+// 読み出し側で全CPU分を合計する。32bit CPUでは合計中に更新されると値が一瞬ずれることがある
+typedef struct
+{
+    u64 count[I2C_BME280_STAT_NUM];
+    u64 hist[I2C_BME280_HIST_NUM][I2C_BME280_HIST_BUCKETS];
+} i2c_bme280_stats;
 
 //
 // declare static functions, structs
 //
 // 各I2Cデバイス(client)に紐づけ。probe時に i2c_set_clientdata で設定
+// remove 後も開いたままのファイルから参照されるので devm では確保せず、参照カウントで解放する
 typedef struct
 {
-    struct cdev        cdev;
-    dev_t              alloced_device_region;
-    struct class*      class;
+    // probe で1つ、open 中のファイル毎に1つ持つ。最後の参照で i2c_bme280_release() が解放する
+    struct kref        kref;
+    // cdev はファイルを閉じた後にも参照されるので、dev_info とは別に確保する
+    struct cdev*       cdev;
+    dev_t              devt;            // このデバイスに割り当てたデバイス番号
     struct i2c_client* client;          
+
+    // 動作設定。変更は config_lock を取ってレジスタ書き込みまで一括で行う
+    i2c_bme280_config       config;
+    struct mutex            config_lock;
+
+    // バスアクセス手順(設定書き込み、forced mode の測定開始〜読み出し)の排他
+    // 複数プロセスからの読み出しが混ざって別々の測定値が組み合わさるのを防ぐ
+    // センサー毎に持つので別のセンサーへのアクセスは妨げない
+    struct mutex            bus_lock;
+
+    // 最新サンプルのキャッシュ
+    // 1変換周期内の読み出しはバスにアクセスせずここから返す。読み出し側はロックを取らない
+    seqlock_t               latest_lock;
+    i2c_bme280_sample       latest;
+    bool                    latest_valid;
+
+    // mmap() でユーザー空間に公開する最新サンプル。sample_lock を取って更新する
+    struct page*            shared_page;
+
+    // 校正値。チップに焼き込まれていて変化しないため probe 時に1度だけ読み出して保持する
+    bme280_comp_temperature dig_t;
+    bme280_comp_pressure    dig_p;
+    bme280_comp_humidity    dig_h;
+
+    // バックグラウンドサンプリング
+    // サンプルは open 中の各ファイルのバッファに配るので、複数のプロセスがそれぞれ全サンプルを読める
+    // バッファへの投入は sample_work, oneshot_work, read() の測定のどれからも行われるが、sample_lock で排他する
+    struct delayed_work     sample_work;
+    // 定期サンプリングしていない時に poll() から要求される1回分の測定
+    struct work_struct      oneshot_work;
+    unsigned long           next_sample;        // 次回サンプリング時刻 [jiffies]
+    u32                     sample_seq;         // 次のサンプルの通し番号。sample_lock を取って更新する
+    struct list_head        files;              // open 中のファイル(i2c_bme280_file)。sample_lock を取って操作する
+    struct mutex            sample_lock;        // サンプル生成(測定〜キャッシュ/バッファ更新)の排他
+    wait_queue_head_t       sample_wait;        // 新しいサンプルが積まれたら起こす
+
+    // open 中のファイル数。最初の open でサンプリング開始、最後の close で停止
+    struct mutex            open_lock;
+    unsigned int            open_count;
+    // remove 済み。open_lock を取って設定し、以降はサンプリングを再開しない
+    // ファイル操作は -ENODEV で失敗する
+    bool                    removed;
+    // 実行中のファイル操作。ファイル操作は read で取り、remove は write で取って完了を待つ
+    // remove が返ると client は解放されるので、それ以降バスにアクセスさせない
+    struct rw_semaphore     remove_lock;
+
+    // 性能カウンタ(CPU毎)
+    i2c_bme280_stats __percpu* stats;
+    struct dentry*          debugfs;
+
+    // バスエラーからの復旧状態。bus_lock を取って更新する
+    bool                    bus_retried;        // 現在の測定中に再試行した
+    bool                    bus_reset;          // ソフトリセット後まだ測定に成功していない
+    s32                     last_error;
+    u32                     consecutive_errors;
+    u64                     last_success;       // [ns]
 } i2c_bme280_device_private;
 
+// open 中のファイル毎の状態。filp->private_data に設定する
+// サンプルバッファはファイル毎に持つので、読み出しても他のファイルのサンプルは減らない
+typedef struct
+{
+    i2c_bme280_device_private* dev_info;
+    struct list_head        node;               // dev_info->files につなぐ
+    atomic_t                dropped;            // バッファ満杯で捨てたサンプル数
+    // 書き込み側は sample_lock で排他されるので、読み出し側だけ排他すれば kfifo にロックは不要
+    // 同じファイルを複数のスレッドや fork した子プロセスから読む場合に備えて read_lock で排他する
+    struct mutex            read_lock;
+    DECLARE_KFIFO(sample_fifo, i2c_bme280_sample, I2C_BME280_FIFO_DEPTH);
+} i2c_bme280_file;
+
 static int i2c_bme280_create_cdev( i2c_bme280_device_private* dev_info );
 static void i2c_bme280_remove_cdev( i2c_bme280_device_private* dev_info );
 
 static int i2c_bme280_probe( struct i2c_client *client, const struct i2c_device_id *id );
 static int i2c_bme280_remove( struct i2c_client *client);
+static void i2c_bme280_release( struct kref* kref );
+static void i2c_bme280_put( void* data );
+static void i2c_bme280_unregister( i2c_bme280_device_private* dev_info );
+static int i2c_bme280_enter( i2c_bme280_device_private* dev_info );
+static void i2c_bme280_leave( i2c_bme280_device_private* dev_info );
 static int i2c_bmc280_init_reg( struct i2c_client *client );
+static int i2c_bme280_load_compensation( i2c_bme280_device_private* dev_info );
+static int i2c_bme280_set_config( i2c_bme280_device_private* dev_info, const i2c_bme280_config* conf );
+static u32 i2c_bme280_meas_time_us( const i2c_bme280_config* conf );
+static u32 i2c_bme280_sampling_interval_us( const i2c_bme280_device_private* dev_info );
 
 static int i2c_bme280_open( struct inode *inode, struct file *file );
 static int i2c_bme280_close( struct inode *inode, struct file *file );
 static ssize_t i2c_bme280_read( struct file *filp, char __user *buf, size_t count, loff_t *f_pos );
+static ssize_t i2c_bme280_read_fifo( struct file *filp, char __user *buf, size_t count );
 static ssize_t i2c_bme280_write( struct file *filp, const char __user *buf, size_t count, loff_t *f_pos );
 static long i2c_bme280_ioctl( struct file *filp, unsigned int cmd, unsigned long arg );
+static long i2c_bme280_ioctl_dispatch( struct file *filp, unsigned int cmd, unsigned long arg );
+static __poll_t i2c_bme280_poll( struct file *filp, struct poll_table_struct *wait );
+static int i2c_bme280_mmap( struct file *filp, struct vm_area_struct *vma );
 
 static int i2c_bme280_read_env_measured( struct file *filp, i2c_bme280_ioctl_param __user* param );
 static int i2c_bme280_read_compensation( struct file *filp, i2c_bme280_ioctl_param __user* param );
-
-static int i2c_bme280_read_regs_data( struct i2c_client* client, const u8* regs, u8* dst, size_t count );
+static int i2c_bme280_read_env_compensated( struct file *filp, i2c_bme280_env_compensated __user* param );
+static int i2c_bme280_read_samples( struct file *filp, i2c_bme280_ioctl_samples __user* param );
+static int i2c_bme280_get_config( struct file *filp, i2c_bme280_config __user* param );
+static int i2c_bme280_set_config_ioctl( struct file *filp, i2c_bme280_config __user* param );
+static int i2c_bme280_get_status( struct file *filp, i2c_bme280_status __user* param );
+
+static int i2c_bme280_measure_raw( i2c_bme280_device_private* dev_info, i2c_bme280_env_raw* raw, u32* flags );
+static int i2c_bme280_soft_reset( i2c_bme280_device_private* dev_info );
+static int i2c_bme280_take_sample( i2c_bme280_device_private* dev_info, i2c_bme280_sample* sample );
+static bool i2c_bme280_read_latest( i2c_bme280_device_private* dev_info, i2c_bme280_sample* sample );
+static void i2c_bme280_update_shared_page( i2c_bme280_device_private* dev_info, const i2c_bme280_sample* sample );
+static int i2c_bme280_get_sample( i2c_bme280_device_private* dev_info, i2c_bme280_sample* sample );
+static int i2c_bme280_force_measurement( i2c_bme280_device_private* dev_info );
+static void i2c_bme280_compensate( const i2c_bme280_device_private* dev_info, const i2c_bme280_env_raw* raw, i2c_bme280_env_compensated* comp );
+
+static int i2c_bme280_read_regs_data( i2c_bme280_device_private* dev_info, u8 reg, u8* dst, size_t count );
+static s32 i2c_bme280_read_reg( i2c_bme280_device_private* dev_info, u8 reg );
+static s32 i2c_bme280_write_reg( i2c_bme280_device_private* dev_info, u8 reg, u8 value );
+static void i2c_bme280_retry_backoff( i2c_bme280_device_private* dev_info, unsigned int attempt );
+
+static void i2c_bme280_stat_add( i2c_bme280_device_private* dev_info, int stat, u64 value );
+static void i2c_bme280_stat_latency( i2c_bme280_device_private* dev_info, int hist, u64 start_ns );
+static u64 i2c_bme280_stat_read( const i2c_bme280_device_private* dev_info, int stat );
+static void i2c_bme280_debugfs_create( i2c_bme280_device_private* dev_info );
+
+static void i2c_bme280_sample_work( struct work_struct* work );
+static void i2c_bme280_oneshot_work( struct work_struct* work );
+static int i2c_bme280_produce_sample( i2c_bme280_device_private* dev_info );
+static void i2c_bme280_restart_sampling( i2c_bme280_device_private* dev_info );
+
+static int i2c_bme280_iio_register( i2c_bme280_device_private* dev_info );
 
 // 
 // define static variables
 //
 
+// 全デバイスで共有するクラスとデバイス番号領域。モジュールロード時に1度だけ確保する
+static struct class* s_bme280_class = NULL;
+static dev_t s_alloced_dev_region;
+// probe されたデバイスへのマイナー番号割り当て。open 時にマイナー番号から dev_info を引く
+// 登録中の dev_info は probe の参照を持っているので、s_bme280_minor_lock を取っていれば参照を取れる
+static DEFINE_IDR( s_bme280_minor_idr );
+static DEFINE_MUTEX( s_bme280_minor_lock );
+// /sys/kernel/debug/i2c_bme280
+static struct dentry* s_bme280_debugfs_root = NULL;
+
+// サンプリング周期 [ms]
+// 0 の場合は動作設定から求めた測定値の更新周期(最大測定時間 + t_sb)に合わせる
+// forced mode で 0 の場合は定期サンプリングせず、read()/ioctl 時にだけ測定する
+static unsigned int sampling_interval_ms = 0;
+module_param( sampling_interval_ms, uint, 0644 );
+MODULE_PARM_DESC( sampling_interval_ms, "background sampling interval in milliseconds (0: follow measurement period)" );
+
+// バスエラー時の再試行回数
+// 再試行の前に bus_retry_delay_us 待ち、再試行する毎に待ち時間を倍にする
+static unsigned int bus_retries = 3;
+module_param( bus_retries, uint, 0644 );
+MODULE_PARM_DESC( bus_retries, "number of retries on I2C bus errors" );
+
+static unsigned int bus_retry_delay_us = 100;
+module_param( bus_retry_delay_us, uint, 0644 );
+MODULE_PARM_DESC( bus_retry_delay_us, "initial backoff before retrying an I2C transfer in microseconds" );
+
+// 再試行しても測定に失敗することがこの回数続いたら、チップをソフトリセットして設定し直す
+// 0 ならリセットしない
+static unsigned int reset_threshold = 3;
+module_param( reset_threshold, uint, 0644 );
+MODULE_PARM_DESC( reset_threshold, "consecutive failed measurements before a soft reset (0: never)" );
+
+// probe 時に forced mode で起動する
+// 読み出し要求があった時だけ測定し、それ以外はチップをスリープさせて消費電力とバス使用を抑える
+static bool forced_mode = false;
+module_param( forced_mode, bool, 0444 );
+MODULE_PARM_DESC( forced_mode, "start in forced mode (measure on demand only)" );
+
+// probe 時の動作設定
+// osrs_t x2, osrs_p x16, osrs_h x1, filter x16, t_sb 0.5ms, normal mode
+static const i2c_bme280_config sk_bme280_default_config = {
+    .osrs_t = 2,
+    .osrs_p = 5,
+    .osrs_h = 1,
+    .filter = 4,
+    .t_sb   = 0,
+    .mode   = BME280_MODE_NORMAL,
+};
+
 // このデバイスドライバで取り扱うデバイスを識別するテーブル
 static struct i2c_device_id i2c_bme280_idtable[] = {
     { "i2c_bme280", 0 },
@@ -89,6 +328,8 @@ static struct file_operations s_bme280_driver_fops = {
     .release = i2c_bme280_close,
     .read    = i2c_bme280_read,
     .write   = i2c_bme280_write,
+    .poll    = i2c_bme280_poll,
+    .mmap    = i2c_bme280_mmap,
     .unlocked_ioctl = i2c_bme280_ioctl,
     .compat_ioctl = i2c_bme280_ioctl,
 };
@@ -98,97 +339,227 @@ static struct file_operations s_bme280_driver_fops = {
 // define static const variables
 //
 
-// BME280 temperature compensation registers "dig_T*"
-static const u8 sk_bme280_temperature_comp_reg[] = {
-    0x88, 0x89, 
-    0x8A, 0x8B,
-    0x8C, 0x8D
-};
-#define I2C_BME280_DIGT_REG_NUM ((int)sizeof(sk_bme280_temperature_comp_reg))
-
-// BME280 pressure compensation registers "dig_P*"
-static const u8 sk_bme280_pressure_comp_reg[] = {
-    0x8E, 0x8F,
-    0x90, 0x91,
-    0x92, 0x93,
-    0x94, 0x95,
-    0x96, 0x97,
-    0x98, 0x99,
-    0x9A, 0x9B,
-    0x9C, 0x9D,
-    0x9E, 0x9F,
-};
-#define I2C_BME280_DIGP_REG_NUM ((int)sizeof(sk_bme280_pressure_comp_reg))
-
-// BME280 humidity compensation registers "dig_H*"
-static const u8 sk_bme280_humidity_comp_reg[] = {
-    0xA1,
-    0xE1, 0xE2,
-    0xE3,
-    0xE4, 0xE5, 0xE6,
-    0xE7,
-};
-#define I2C_BME280_DIGH_REG_NUM ((int)sizeof(sk_bme280_humidity_comp_reg))
+// BME280 compensation registers "calib00" - "calib25" (0x88 - 0xA1)
+// dig_T1 - dig_T3, dig_P1 - dig_P9, (reserved 0xA0), dig_H1
+#define I2C_BME280_CALIB00_REG      0x88
+#define I2C_BME280_CALIB00_REG_NUM  26
+
+// BME280 compensation registers "calib26" - "calib32" (0xE1 - 0xE7)
+// dig_H2 - dig_H6
+#define I2C_BME280_CALIB26_REG      0xE1
+#define I2C_BME280_CALIB26_REG_NUM  7
+
+// BME280 measurement registers "press", "temp", "hum" (0xF7 - 0xFE)
+// 3種類の測定値を1回のバースト読み出しで取得すること。
+// バースト読み出し中はシャドーレジスタが更新されないため、同一測定サイクルの値が揃う
+#define I2C_BME280_DATA_REG         0xF7
+#define I2C_BME280_DATA_REG_NUM     8
+
+// 設定値とsysfsで扱う値の対応
+// oversampling ratio (osrs_*)
+static const u32 sk_bme280_oversampling[] = { 0, 1, 2, 4, 8, 16 };
+// IIR filter coefficient (filter)
+static const u32 sk_bme280_filter_coef[] = { 0, 2, 4, 8, 16 };
+// standby time [us] (t_sb)
+static const u32 sk_bme280_standby_us[] = { 500, 62500, 125000, 250000, 500000, 1000000, 10000, 20000 };
+// mode
+static const char* const sk_bme280_mode_name[] = { "sleep", "forced", NULL, "normal" };
+
+//
+// sysfs attributes
+// /sys/class/i2c_bme280_class/i2c_bme280-<bus>-<addr>/ 以下に見える
+// 値はレジスタ設定値ではなく倍率や時間などの実際の値で読み書きする
+//
+
+// 設定の1項目を変更する。value は table に含まれる値であること
+static ssize_t i2c_bme280_store_config( i2c_bme280_device_private* dev_info, const char* buf, size_t count,
+                                        const u32* table, size_t table_num, size_t offset )
+{
+    i2c_bme280_config conf;
+    u32 value;
+    int index;
+    int result;
+
+    result = kstrtou32( buf, 0, &value );
+    if( result != 0 ){
+        return result;
+    }
+    for( index = 0; index < table_num; ++index ){
+        if( table[index] == value ){
+            break;
+        }
+    }
+    if( index == table_num ){
+        return -EINVAL;
+    }
+
+    mutex_lock( &dev_info->config_lock );
+    conf = dev_info->config;
+    *((u8*)&conf + offset) = index;
+    result = i2c_bme280_set_config( dev_info, &conf );
+    mutex_unlock( &dev_info->config_lock );
+
+    return result != 0 ? result : count;
+}
 
-// BME280 read pressure register "press"
-static const u8 sk_bme280_press_reg[] = {
-    0xF7, 0xF8, 0xF9,
+#define I2C_BME280_CONFIG_ATTR( _name, _table )                                                             \
+static ssize_t _name##_show( struct device *dev, struct device_attribute *attr, char *buf )                 \
+{                                                                                                           \
+    i2c_bme280_device_private* dev_info = dev_get_drvdata( dev );                                           \
+    return sprintf( buf, "%u\n", _table[dev_info->config._name] );                                          \
+}                                                                                                           \
+static ssize_t _name##_store( struct device *dev, struct device_attribute *attr, const char *buf, size_t count ) \
+{                                                                                                           \
+    return i2c_bme280_store_config( dev_get_drvdata( dev ), buf, count,                                     \
+                                    _table, ARRAY_SIZE(_table), offsetof(i2c_bme280_config, _name) );       \
+}                                                                                                           \
+static DEVICE_ATTR_RW( _name )
+
+I2C_BME280_CONFIG_ATTR( osrs_t, sk_bme280_oversampling );
+I2C_BME280_CONFIG_ATTR( osrs_p, sk_bme280_oversampling );
+I2C_BME280_CONFIG_ATTR( osrs_h, sk_bme280_oversampling );
+I2C_BME280_CONFIG_ATTR( filter, sk_bme280_filter_coef );
+I2C_BME280_CONFIG_ATTR( t_sb,   sk_bme280_standby_us );
+
+static ssize_t mode_show( struct device *dev, struct device_attribute *attr, char *buf )
+{
+    i2c_bme280_device_private* dev_info = dev_get_drvdata( dev );
+    return sprintf( buf, "%s\n", sk_bme280_mode_name[dev_info->config.mode] );
+}
+
+static ssize_t mode_store( struct device *dev, struct device_attribute *attr, const char *buf, size_t count )
+{
+    i2c_bme280_device_private* dev_info = dev_get_drvdata( dev );
+    i2c_bme280_config conf;
+    int mode;
+    int result;
+
+    for( mode = 0; mode < ARRAY_SIZE(sk_bme280_mode_name); ++mode ){
+        if( sk_bme280_mode_name[mode] != NULL && sysfs_streq( buf, sk_bme280_mode_name[mode] ) ){
+            break;
+        }
+    }
+    if( mode == ARRAY_SIZE(sk_bme280_mode_name) ){
+        return -EINVAL;
+    }
+
+    mutex_lock( &dev_info->config_lock );
+    conf = dev_info->config;
+    conf.mode = mode;
+    result = i2c_bme280_set_config( dev_info, &conf );
+    mutex_unlock( &dev_info->config_lock );
+
+    return result != 0 ? result : count;
+}
+static DEVICE_ATTR_RW( mode );
+
+// 現在の設定での最大測定時間 [us]
+static ssize_t meas_time_us_show( struct device *dev, struct device_attribute *attr, char *buf )
+{
+    i2c_bme280_device_private* dev_info = dev_get_drvdata( dev );
+    return sprintf( buf, "%u\n", dev_info->config.meas_time_us );
+}
+static DEVICE_ATTR_RO( meas_time_us );
+
+static struct attribute* i2c_bme280_attrs[] = {
+    &dev_attr_osrs_t.attr,
+    &dev_attr_osrs_p.attr,
+    &dev_attr_osrs_h.attr,
+    &dev_attr_filter.attr,
+    &dev_attr_t_sb.attr,
+    &dev_attr_mode.attr,
+    &dev_attr_meas_time_us.attr,
+    NULL,
 };
-#define I2C_BME280_PRESS_REG_NUM ((int)sizeof(sk_bme280_press_reg))
 
-// BME280 read temperature register "temp"
-static const u8 sk_bme280_temp_reg[] = {
-    0xFA, 0xFB, 0xFC,
+// 性能カウンタの合計値。stats/ 以下に見える
+// ヒストグラムは debugfs の stats で読む
+#define I2C_BME280_STAT_ATTR( _name, _stat )                                                                \
+static ssize_t _name##_show( struct device *dev, struct device_attribute *attr, char *buf )                 \
+{                                                                                                           \
+    return sprintf( buf, "%llu\n", i2c_bme280_stat_read( dev_get_drvdata( dev ), _stat ) );                 \
+}                                                                                                           \
+static DEVICE_ATTR_RO( _name )
+
+I2C_BME280_STAT_ATTR( samples,      I2C_BME280_STAT_SAMPLES );
+I2C_BME280_STAT_ATTR( transactions, I2C_BME280_STAT_TRANSACTIONS );
+I2C_BME280_STAT_ATTR( bytes,        I2C_BME280_STAT_BYTES );
+I2C_BME280_STAT_ATTR( errors,       I2C_BME280_STAT_ERRORS );
+I2C_BME280_STAT_ATTR( retries,      I2C_BME280_STAT_RETRIES );
+I2C_BME280_STAT_ATTR( cache_hits,   I2C_BME280_STAT_CACHE_HITS );
+I2C_BME280_STAT_ATTR( cache_misses, I2C_BME280_STAT_CACHE_MISSES );
+I2C_BME280_STAT_ATTR( resets,       I2C_BME280_STAT_RESETS );
+
+static struct attribute* i2c_bme280_stats_attrs[] = {
+    &dev_attr_samples.attr,
+    &dev_attr_transactions.attr,
+    &dev_attr_bytes.attr,
+    &dev_attr_errors.attr,
+    &dev_attr_retries.attr,
+    &dev_attr_cache_hits.attr,
+    &dev_attr_cache_misses.attr,
+    &dev_attr_resets.attr,
+    NULL,
 };
-#define I2C_BME280_TEMP_REG_NUM ((int)sizeof(sk_bme280_temp_reg))
 
-// BME280 read humidity register "hum"
-static const u8 sk_bme280_hum_reg[] = {
-    0xFD, 0xFE,
+static const struct attribute_group i2c_bme280_group = {
+    .attrs = i2c_bme280_attrs,
+};
+static const struct attribute_group i2c_bme280_stats_group = {
+    .name  = "stats",
+    .attrs = i2c_bme280_stats_attrs,
+};
+static const struct attribute_group* i2c_bme280_groups[] = {
+    &i2c_bme280_group,
+    &i2c_bme280_stats_group,
+    NULL,
 };
-#define I2C_BME280_HUM_REG_NUM ((int)sizeof(sk_bme280_hum_reg))
 
 static int i2c_bme280_create_cdev( i2c_bme280_device_private* dev_info )
 {
-    dev_t curr_dev;
+    int minor;
     int result = 0;
     struct device *created_dev = NULL;
-
-    // 空いているメジャー番号を確保
-    result = alloc_chrdev_region( &(dev_info->alloced_device_region), MINOR_BASE, I2C_BANK, DRIVER_NAME );
-    if( result < 0 ){
-        pr_err( "%s failed. alloc_chrdev_region = %d\n", __func__, result );
-        goto REGION_ERR;
-    }
-
-    // デバイスクラス登録  /sys/class に見えるようになる
-    dev_info->class = class_create( THIS_MODULE, DRIVER_CLASS );
-    if( IS_ERR(dev_info->class) ){
-        result = PTR_ERR( dev_info->class );
-        pr_err( "%s failed. class_create = %d\n", __func__, result );
-        goto CREATE_CLASS_ERR;
+    struct i2c_client* client = dev_info->client;
+
+    // 空いているマイナー番号を確保
+    mutex_lock( &s_bme280_minor_lock );
+    minor = idr_alloc( &s_bme280_minor_idr, dev_info, 0, I2C_BANK, GFP_KERNEL );
+    mutex_unlock( &s_bme280_minor_lock );
+    if( minor < 0 ){
+        pr_err( "%s failed. idr_alloc = %d\n", __func__, minor );
+        goto MINOR_ALLOC_ERR;
     }
+    // デバイス番号を生成
+    dev_info->devt = MKDEV(MAJOR(s_alloced_dev_region), MINOR(s_alloced_dev_region) + minor);
 
     // ファイル操作関数をバインド
-    cdev_init( &(dev_info->cdev), &s_bme280_driver_fops );
-    dev_info->cdev.owner = THIS_MODULE;
-    // デバイス番号を生成
-    curr_dev = MKDEV(MAJOR(dev_info->alloced_device_region), MINOR(dev_info->alloced_device_region));
+    // 最後のファイルを閉じた後に参照が外れた時点で自動的に解放される
+    dev_info->cdev = cdev_alloc();
+    if( dev_info->cdev == NULL ){
+        pr_err( "%s failed. cdev_alloc\n", __func__ );
+        goto CDEV_ALLOC_ERR;
+    }
+    dev_info->cdev->ops = &s_bme280_driver_fops;
+    dev_info->cdev->owner = THIS_MODULE;
     // このデバイスドライバをカーネルに登録する
-    result = cdev_add( &(dev_info->cdev), curr_dev, 1 );
+    result = cdev_add( dev_info->cdev, dev_info->devt, 1 );
     if( result != 0 ){
         pr_err( "%s failed. cdev_add = %d\n", __func__, result );
         goto CDEV_ADD_ERR;
     }
 
     // デバイスノードを作成。作成したノードは/dev以下からアクセス可能
-    created_dev = device_create( 
-            dev_info->class,
-            NULL,               // no parent device
-            curr_dev,
-            NULL,               // no additional data
-            DRIVER_NAME );      // i2c_bme280
-
+    // 複数のセンサーを区別できるようバス番号とアドレスを名前に含める
+    created_dev = device_create_with_groups( 
+            s_bme280_class,
+            &client->dev,       // parent device
+            dev_info->devt,
+            dev_info,
+            i2c_bme280_groups,  // sysfs attributes
+            DRIVER_NAME "-%d-%02x",
+            client->adapter->nr,
+            client->addr );     // i2c_bme280-1-76
 
     if( IS_ERR(created_dev) ){
         result = PTR_ERR( created_dev );
@@ -196,46 +567,47 @@ static int i2c_bme280_create_cdev( i2c_bme280_device_private* dev_info )
         goto DEV_CREATE_ERR;
     }
 
-    pr_info( "%s succeeded", __func__ );
+    pr_debug( "%s succeeded", __func__ );
 
     // initialize succeeded
     return 0;
 
     // error bailout
 DEV_CREATE_ERR:
-    cdev_del( &dev_info->cdev );
+    cdev_del( dev_info->cdev );
+    dev_info->cdev = NULL;
 CDEV_ADD_ERR:
-    class_destroy( dev_info->class );
-CREATE_CLASS_ERR:
-    unregister_chrdev_region( dev_info->alloced_device_region, I2C_BANK );
-REGION_ERR:
+    if( dev_info->cdev != NULL ){
+        kobject_put( &dev_info->cdev->kobj );
+        dev_info->cdev = NULL;
+    }
+CDEV_ALLOC_ERR:
+    mutex_lock( &s_bme280_minor_lock );
+    idr_remove( &s_bme280_minor_idr, minor );
+    mutex_unlock( &s_bme280_minor_lock );
+MINOR_ALLOC_ERR:
     return -ENXIO;
 }
 
 static void i2c_bme280_remove_cdev( i2c_bme280_device_private* dev_info )
 {
-    dev_t dev;
-    dev = MKDEV(MAJOR(dev_info->alloced_device_region), MINOR(dev_info->alloced_device_region));
-
-    // デバイスノード削除
-    device_destroy( dev_info->class, dev );
-    // キャラクターデバイスをKernelから削除
-    cdev_del( &(dev_info->cdev) );
-    // デバイスのクラス登録を削除
-    class_destroy( dev_info->class );
-    // デバイスが使用していたメジャー番号の登録削除
-    unregister_chrdev_region( dev, I2C_BANK );
+    // マイナー番号を返却。以降の open はこのデバイスを見つけられない
+    mutex_lock( &s_bme280_minor_lock );
+    idr_remove( &s_bme280_minor_idr, MINOR(dev_info->devt) - MINOR(s_alloced_dev_region) );
+    mutex_unlock( &s_bme280_minor_lock );
+    // デバイスノード削除(sysfs属性も削除される)
+    device_destroy( s_bme280_class, dev_info->devt );
+    // キャラクターデバイスをKernelから削除。開いたままのファイルがあれば、閉じられた後で解放される
+    cdev_del( dev_info->cdev );
+    dev_info->cdev = NULL;
 }
 
 static int i2c_bme280_probe( struct i2c_client *client, const struct i2c_device_id *id )
 {
     int chipid;
+    int result;
     i2c_bme280_device_private* dev_info;
 
-    pr_info( "%s\n", __func__ );
-    pr_info( "id.name = %s, id.driver_data = %ld\n", id->name, id->driver_data );
-    pr_info( "slave address = 0x%02X\n", client->addr );
-
     // check functionallity smbus read
     if( !i2c_check_functionality( client->adapter, I2C_FUNC_SMBUS_BYTE_DATA )){
         return -EIO;
@@ -244,77 +616,194 @@ static int i2c_bme280_probe( struct i2c_client *client, const struct i2c_device_
     // check connected device is bme280 or not
     // read chipid
     chipid = i2c_smbus_read_byte_data( client, 0xD0 );
+    trace_i2c_bme280_probe( client, chipid );
     if( chipid != 0x60 ){
         pr_err( "connected device is not bme280! chipid = 0x%02X\n", chipid );
         return -ENODEV;
     }
 
+    // remove 後も開いたままのファイルから参照されるので、参照カウントで解放する
+    // probe の参照は devm で remove 後(IIOデバイスの登録解除後)に外す
+    dev_info = (i2c_bme280_device_private*)kzalloc( sizeof(i2c_bme280_device_private), GFP_KERNEL );
+    if( dev_info == NULL ){
+        return -ENOMEM;
+    }
+    kref_init( &dev_info->kref );
+    result = devm_add_action_or_reset( &client->dev, i2c_bme280_put, dev_info );
+    if( result != 0 ){
+        return result;
+    }
+    dev_info->client = client;
+    dev_info->config = sk_bme280_default_config;
+    if( forced_mode ){
+        dev_info->config.mode = BME280_MODE_FORCED;
+    }
+    dev_info->config.meas_time_us = i2c_bme280_meas_time_us( &dev_info->config );
+    mutex_init( &dev_info->config_lock );
+    mutex_init( &dev_info->bus_lock );
+    seqlock_init( &dev_info->latest_lock );
+    INIT_DELAYED_WORK( &dev_info->sample_work, i2c_bme280_sample_work );
+    INIT_WORK( &dev_info->oneshot_work, i2c_bme280_oneshot_work );
+    INIT_LIST_HEAD( &dev_info->files );
+    mutex_init( &dev_info->sample_lock );
+    init_waitqueue_head( &dev_info->sample_wait );
+    mutex_init( &dev_info->open_lock );
+    init_rwsem( &dev_info->remove_lock );
+    i2c_set_clientdata( client, dev_info );
+
+    // mmap() 用の共有ページ。dev_info と一緒に解放する
+    dev_info->shared_page = alloc_page( GFP_KERNEL | __GFP_ZERO );
+    if( dev_info->shared_page == NULL ){
+        return -ENOMEM;
+    }
+
+    // 性能カウンタ。レジスタ設定からバスアクセスを数える
+    dev_info->stats = alloc_percpu( i2c_bme280_stats );
+    if( dev_info->stats == NULL ){
+        return -ENOMEM;
+    }
+
     // コンフィギュレーションレジスタの設定
     if( i2c_bmc280_init_reg( client ) != 0 ){
         return -ENODEV;
     }
 
-    // デバイスに紐づけてメモリ確保、アンロード時に自動開放
-    // devm_kzalloc は probe 時に使用することを想定しているらしい
-    dev_info = (i2c_bme280_device_private*)devm_kzalloc(&client->dev, sizeof(i2c_bme280_device_private), GFP_KERNEL);
-    dev_info->client = client;
-    i2c_set_clientdata( client, dev_info );
+    // 校正値を読み出してキャッシュ
+    if( i2c_bme280_load_compensation( dev_info ) != 0 ){
+        return -ENODEV;
+    }
 
-    pr_info( "detected bme280. chipid = 0x%02X\n", chipid );
+    pr_info( "detected bme280 on i2c-%d 0x%02X\n", client->adapter->nr, client->addr );
     if( i2c_bme280_create_cdev(dev_info) != 0 ){
         return -ENXIO;
     }
 
+    // IIOデバイス登録。IIOの資源はdevm管理なので remove 後に自動で解放される
+    result = i2c_bme280_iio_register( dev_info );
+    if( result != 0 ){
+        i2c_bme280_unregister( dev_info );
+        return result;
+    }
+
+    i2c_bme280_debugfs_create( dev_info );
+
+    return 0;
+}
+
+// 最後の参照が外れたら呼ばれる
+static void i2c_bme280_release( struct kref* kref )
+{
+    i2c_bme280_device_private* dev_info = container_of( kref, i2c_bme280_device_private, kref );
+
+    free_percpu( dev_info->stats );
+    // mmap されていればマッピング側の参照が残るので、ページ自体は munmap まで解放されない
+    if( dev_info->shared_page != NULL ){
+        __free_page( dev_info->shared_page );
+    }
+    kfree( dev_info );
+}
+
+// probe の参照を外す(devm action)
+static void i2c_bme280_put( void* data )
+{
+    i2c_bme280_device_private* dev_info = data;
+
+    kref_put( &dev_info->kref, i2c_bme280_release );
+}
+
+// ファイル操作の開始。remove 済みなら -ENODEV
+// 成功したら i2c_bme280_leave() を呼ぶまで client は有効
+static int i2c_bme280_enter( i2c_bme280_device_private* dev_info )
+{
+    down_read( &dev_info->remove_lock );
+    if( READ_ONCE( dev_info->removed ) ){
+        up_read( &dev_info->remove_lock );
+        return -ENODEV;
+    }
     return 0;
 }
 
+static void i2c_bme280_leave( i2c_bme280_device_private* dev_info )
+{
+    up_read( &dev_info->remove_lock );
+}
+
 static int i2c_bme280_remove( struct i2c_client *client )
 {
     i2c_bme280_device_private* dev_info;
-    pr_info( "%s\n", __func__ );
+    pr_debug( "%s\n", __func__ );
 
     dev_info = i2c_get_clientdata( client );
-    i2c_bme280_remove_cdev( dev_info );
+    debugfs_remove_recursive( dev_info->debugfs );
+    i2c_bme280_unregister( dev_info );
 
+    // dev_info は開いたままのファイルが閉じられるまで残る
     return 0;
 }
 
+// デバイスノードを削除し、開いたままのファイルからバスにアクセスされないようにする
+// 戻った後は client にアクセスしない
+static void i2c_bme280_unregister( i2c_bme280_device_private* dev_info )
+{
+    // 以降の open とサンプリングの再開を止める
+    mutex_lock( &dev_info->open_lock );
+    WRITE_ONCE( dev_info->removed, true );
+    mutex_unlock( &dev_info->open_lock );
+
+    // read() で待っているプロセスを起こし、実行中のファイル操作が終わるのを待つ
+    wake_up_interruptible_all( &dev_info->sample_wait );
+    down_write( &dev_info->remove_lock );
+    up_write( &dev_info->remove_lock );
+
+    i2c_bme280_remove_cdev( dev_info );
+    cancel_delayed_work_sync( &dev_info->sample_work );
+    cancel_work_sync( &dev_info->oneshot_work );
+}
+
+// dev_info->config の内容をレジスタに設定する
 static int i2c_bmc280_init_reg( struct i2c_client *client )
 {  
     u8 reg;
     u8 value;
+    i2c_bme280_device_private* dev_info;
+    const i2c_bme280_config* conf;
+
+    dev_info = (i2c_bme280_device_private*)i2c_get_clientdata( client );
+    conf = &(dev_info->config);
+
+    // set "ctrl_meas(0xF4)" register
+    // config への書き込みは normal mode 中だと無視されることがあるので一旦 sleep mode にする
+    // value = |osrs_t[2:0]|osrs_p[2:0]|00|
+    reg = 0xF4;
+    value = (conf->osrs_t << 5) | (conf->osrs_p << 2) | BME280_MODE_SLEEP;
+    if( i2c_bme280_write_reg( dev_info, reg, value ) != 0 ){
+        goto I2C_BMC280_INIT_REG_BAILOUT;
+    }
 
     // set "config(0xF5)" register
-    // t_sb[2:0]   = 0.5ms(000)
-    // filter[2:0] = filter x16(100)
     // spi3w_en[0] = 3wire SPI(0)
-    // value = |000|100|*|0|
+    // value = |t_sb[2:0]|filter[2:0]|*|0|
     reg = 0xF5;
-    value = 0x10;
-    pr_info( "%s set reg=0x%02X, value=0x%02X", __func__, reg, value );
-    if( i2c_smbus_write_byte_data( client, reg, value ) != 0 ){
+    value = (conf->t_sb << 5) | (conf->filter << 2);
+    if( i2c_bme280_write_reg( dev_info, reg, value ) != 0 ){
         goto I2C_BMC280_INIT_REG_BAILOUT;
     }
 
-    // set "ctrl_meas(0xF4)" register
-    // osrs_t[2:0]     = oversamplingx2(010)
-    // osrs_p[2:0]     = oversamplingx16(101)
-    // mode[1:0]       = normal mode(11)
-    // value = |010|101|11|
-    reg = 0xF4;
-    value = 0x57;
-    pr_info( "%s set reg=0x%02X, value=0x%02X", __func__, reg, value );
-    if( i2c_smbus_write_byte_data( client, reg, value ) != 0 ){
+    // set "ctrl_hum(0xF2)" register
+    // ctrl_meas を書き込んだ時点で有効になる
+    // value = |*****|osrs_h[2:0]|
+    reg = 0xF2;
+    value = conf->osrs_h;
+    if( i2c_bme280_write_reg( dev_info, reg, value ) != 0 ){
         goto I2C_BMC280_INIT_REG_BAILOUT;
     }
 
-    // set "ctrl_hum(0xF2)" register
-    // osrs_h[2:0]  = oversamplingx1(001)
-    // value = |*****|001|
-    reg = 0xF2;
-    value = 0x01;
-    pr_info( "%s set reg=0x%02X, value=0x%02X", __func__, reg, value );
-    if( i2c_smbus_write_byte_data( client, reg, value ) != 0 ){
+    // set "ctrl_meas(0xF4)" register
+    // forced mode は測定要求時に i2c_bme280_measure_raw() で開始するので、ここではスリープのままにする
+    // value = |osrs_t[2:0]|osrs_p[2:0]|mode[1:0]|
+    reg = 0xF4;
+    value = (conf->osrs_t << 5) | (conf->osrs_p << 2) | (conf->mode == BME280_MODE_FORCED ? BME280_MODE_SLEEP : conf->mode);
+    if( i2c_bme280_write_reg( dev_info, reg, value ) != 0 ){
         goto I2C_BMC280_INIT_REG_BAILOUT;
     }
 
@@ -325,20 +814,135 @@ I2C_BMC280_INIT_REG_BAILOUT:
     return -ENODEV;
 }
 
+// 動作設定を検証してレジスタへ反映する。config_lock を取った状態で呼ぶこと
+// 1項目でも不正なら何も変更しない。レジスタ書き込みに失敗した場合は元の設定に戻す
+static int i2c_bme280_set_config( i2c_bme280_device_private* dev_info, const i2c_bme280_config* conf )
+{
+    i2c_bme280_config old;
+    int result;
+
+    if( conf->osrs_t > 5 || conf->osrs_p > 5 || conf->osrs_h > 5 || conf->filter > 4 || conf->t_sb > 7 ){
+        return -EINVAL;
+    }
+    if( conf->mode != BME280_MODE_SLEEP && conf->mode != BME280_MODE_FORCED && conf->mode != BME280_MODE_NORMAL ){
+        return -EINVAL;
+    }
+
+    lockdep_assert_held( &dev_info->config_lock );
+
+    // 設定値の更新からレジスタ書き込みまでの間に測定が割り込まないようにする
+    mutex_lock( &dev_info->bus_lock );
+
+    old = dev_info->config;
+    dev_info->config = *conf;
+    dev_info->config.reserved = 0;
+    dev_info->config.meas_time_us = i2c_bme280_meas_time_us( conf );
+
+    result = i2c_bmc280_init_reg( dev_info->client );
+    if( result != 0 ){
+        dev_info->config = old;
+        i2c_bmc280_init_reg( dev_info->client );
+    }
+
+    // 古い設定で測定した値は返さない
+    write_seqlock( &dev_info->latest_lock );
+    dev_info->latest_valid = false;
+    write_sequnlock( &dev_info->latest_lock );
+
+    mutex_unlock( &dev_info->bus_lock );
+
+    // 動作モードやサンプリング周期が変わるのでサンプリングをやり直す
+    i2c_bme280_restart_sampling( dev_info );
+
+    return result;
+}
+
+// データシート 9.1 Measurement time の最大測定時間 [us]
+// t_meas,max = 1.25 + 2.3 * osrs_t + (2.3 * osrs_p + 0.575) + (2.3 * osrs_h + 0.575) [ms]
+// skip した項目の時間は含めない
+static u32 i2c_bme280_meas_time_us( const i2c_bme280_config* conf )
+{
+    u32 meas_time = 1250;
+
+    if( conf->osrs_t != 0 ){
+        meas_time += 2300 * (1 << (conf->osrs_t - 1));
+    }
+    if( conf->osrs_p != 0 ){
+        meas_time += 2300 * (1 << (conf->osrs_p - 1)) + 575;
+    }
+    if( conf->osrs_h != 0 ){
+        meas_time += 2300 * (1 << (conf->osrs_h - 1)) + 575;
+    }
+
+    return meas_time;
+}
+
+// バックグラウンドサンプリングの周期 [us]
+// normal mode では最大測定時間 + t_sb 毎に測定値が更新されるのでそれに合わせる
+// 定期サンプリングしない場合(forced/sleep mode で周期指定なし)は 0
+static u32 i2c_bme280_sampling_interval_us( const i2c_bme280_device_private* dev_info )
+{
+    if( sampling_interval_ms != 0 ){
+        return sampling_interval_ms * 1000;
+    }
+    if( dev_info->config.mode != BME280_MODE_NORMAL ){
+        return 0;
+    }
+
+    return dev_info->config.meas_time_us + sk_bme280_standby_us[dev_info->config.t_sb];
+}
+
 // open時に呼ばれる関数
 static int i2c_bme280_open( struct inode *inode, struct file *filp )
 {
     i2c_bme280_device_private* dev_info;
+    i2c_bme280_file* file;
     pr_debug( "%s", __func__ );
 
-    dev_info = container_of(inode->i_cdev, i2c_bme280_device_private, cdev);
-    if( dev_info == NULL || dev_info->client == NULL ){
-        pr_err( "%s container_of() failed\n", __func__ );
-        return -EFAULT;
+    file = kzalloc( sizeof(i2c_bme280_file), GFP_KERNEL );
+    if( file == NULL ){
+        return -ENOMEM;
+    }
+    atomic_set( &file->dropped, 0 );
+    mutex_init( &file->read_lock );
+    INIT_KFIFO( file->sample_fifo );
+
+    // ファイルを閉じるまで dev_info の参照を持つ
+    mutex_lock( &s_bme280_minor_lock );
+    dev_info = idr_find( &s_bme280_minor_idr, iminor(inode) - MINOR(s_alloced_dev_region) );
+    if( dev_info != NULL ){
+        kref_get( &dev_info->kref );
+    }
+    mutex_unlock( &s_bme280_minor_lock );
+    if( dev_info == NULL ){
+        kfree( file );
+        return -ENODEV;
     }
 
-    filp->private_data = dev_info;
-    pr_debug( "i2c address = 0x%02X", dev_info->client->addr );
+    file->dev_info = dev_info;
+    filp->private_data = file;
+
+    // 以降のサンプルをこのファイルのバッファにも配る
+    mutex_lock( &dev_info->sample_lock );
+    list_add_tail( &file->node, &dev_info->files );
+    mutex_unlock( &dev_info->sample_lock );
+
+    // 最初の open でバックグラウンドサンプリングを開始
+    mutex_lock( &dev_info->open_lock );
+    if( dev_info->removed ){
+        mutex_unlock( &dev_info->open_lock );
+        mutex_lock( &dev_info->sample_lock );
+        list_del( &file->node );
+        mutex_unlock( &dev_info->sample_lock );
+        kfree( file );
+        kref_put( &dev_info->kref, i2c_bme280_release );
+        return -ENODEV;
+    }
+    if( dev_info->open_count++ == 0 ){
+        dev_info->next_sample = jiffies;
+        schedule_delayed_work( &dev_info->sample_work, 0 );
+    }
+    mutex_unlock( &dev_info->open_lock );
 
     return 0;
 }
@@ -346,15 +950,107 @@ static int i2c_bme280_open( struct inode *inode, struct file *filp )
 // close時に呼ばれる関数
 static int i2c_bme280_close( struct inode *inode, struct file *filp )
 {
+    i2c_bme280_device_private* dev_info;
+    i2c_bme280_file* file;
     pr_debug( "%s", __func__ );
+
+    file = (i2c_bme280_file*)filp->private_data;
+    dev_info = file->dev_info;
+
+    mutex_lock( &dev_info->sample_lock );
+    list_del( &file->node );
+    mutex_unlock( &dev_info->sample_lock );
+    kfree( file );
+
+    // 誰も使っていなければサンプリングを止めてバスを空ける
+    mutex_lock( &dev_info->open_lock );
+    if( --dev_info->open_count == 0 ){
+        cancel_delayed_work_sync( &dev_info->sample_work );
+        cancel_work_sync( &dev_info->oneshot_work );
+    }
+    mutex_unlock( &dev_info->open_lock );
+
+    // remove 済みならここで解放されることがある
+    kref_put( &dev_info->kref, i2c_bme280_release );
+
     return 0;
 }
 
 // read時に呼ばれる関数
+// このファイルのサンプルバッファに溜まっている i2c_bme280_sample を count に収まるだけ返す
 static ssize_t i2c_bme280_read( struct file* filp, char __user *buf, size_t count, loff_t *f_pos )
 {
+    i2c_bme280_device_private* dev_info;
+    ssize_t result;
+
     pr_debug( "%s", __func__ );
-    return 0;
+
+    // 固定長レコード単位でしか読み出せない
+    if( count < sizeof(i2c_bme280_sample) ){
+        return -EINVAL;
+    }
+
+    dev_info = ((i2c_bme280_file*)filp->private_data)->dev_info;
+
+    result = i2c_bme280_enter( dev_info );
+    if( result != 0 ){
+        return result;
+    }
+    result = i2c_bme280_read_fifo( filp, buf, count );
+    i2c_bme280_leave( dev_info );
+
+    return result;
+}
+
+// i2c_bme280_read() の本体。サンプルが無ければ積まれるか remove されるまで待つ
+static ssize_t i2c_bme280_read_fifo( struct file *filp, char __user *buf, size_t count )
+{
+    i2c_bme280_device_private* dev_info;
+    i2c_bme280_file* file;
+    unsigned int copied;
+    int result;
+
+    file = (i2c_bme280_file*)filp->private_data;
+    dev_info = file->dev_info;
+
+    for( ;; ){
+        // 定期サンプリングしていない forced mode では、ここで1回測定する
+        if( kfifo_is_empty( &file->sample_fifo ) && i2c_bme280_sampling_interval_us( dev_info ) == 0 ){
+            result = i2c_bme280_produce_sample( dev_info );
+            if( result != 0 ){
+                return result;
+            }
+        }
+
+        // サンプルが無ければ次のサンプルが積まれるまで待つ
+        if( kfifo_is_empty( &file->sample_fifo ) ){
+            if( filp->f_flags & O_NONBLOCK ){
+                return -EAGAIN;
+            }
+            if( wait_event_interruptible( dev_info->sample_wait,
+                                          !kfifo_is_empty( &file->sample_fifo ) || READ_ONCE( dev_info->removed ) ) != 0 ){
+                return -ERESTARTSYS;
+            }
+            if( READ_ONCE( dev_info->removed ) ){
+                return -ENODEV;
+            }
+        }
+
+        if( mutex_lock_interruptible( &file->read_lock ) != 0 ){
+            return -ERESTARTSYS;
+        }
+        result = kfifo_to_user( &file->sample_fifo, buf, count, &copied );
+        mutex_unlock( &file->read_lock );
+
+        if( result != 0 ){
+            return result;
+        }
+        // 同じファイルを読む他のスレッドに先に読まれていたら待ち直す
+        if( copied != 0 ){
+            i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_SAMPLES, copied / sizeof(i2c_bme280_sample) );
+            return copied;
+        }
+    }
 }
 
 // write時に呼ばれる関数
@@ -365,132 +1061,297 @@ static ssize_t i2c_bme280_write( struct file *filp, const char __user *buf, size
 }
 
 static long i2c_bme280_ioctl( struct file *filp, unsigned int cmd, unsigned long arg )
+{
+    i2c_bme280_device_private* dev_info;
+    u64 start = ktime_get_ns();
+    long result;
+
+    dev_info = ((i2c_bme280_file*)filp->private_data)->dev_info;
+
+    result = i2c_bme280_enter( dev_info );
+    if( result != 0 ){
+        return result;
+    }
+
+    trace_i2c_bme280_ioctl_enter( dev_info->client, cmd );
+    result = i2c_bme280_ioctl_dispatch( filp, cmd, arg );
+    trace_i2c_bme280_ioctl_exit( dev_info->client, cmd, result );
+    i2c_bme280_stat_latency( dev_info, I2C_BME280_HIST_IOCTL, start );
+
+    i2c_bme280_leave( dev_info );
+
+    return result;
+}
+
+static long i2c_bme280_ioctl_dispatch( struct file *filp, unsigned int cmd, unsigned long arg )
 {
     i2c_bme280_ioctl_param __user* param;
-    param = (i2c_bme280_ioctl_param __user*)arg;
+    long result;
 
-    pr_debug( "%s", __func__ );
+    param = (i2c_bme280_ioctl_param __user*)arg;
 
     switch( cmd ){
     case I2C_BME280_READ_ENV_MEASURED:
-        return i2c_bme280_read_env_measured( filp, param );
+        result = i2c_bme280_read_env_measured( filp, param );
+        break;
     case I2C_BME280_READ_COMPENSATION:
-        return i2c_bme280_read_compensation( filp, param );
+        result = i2c_bme280_read_compensation( filp, param );
+        break;
+    case I2C_BME280_READ_ENV_COMPENSATED:
+        result = i2c_bme280_read_env_compensated( filp, (i2c_bme280_env_compensated __user*)arg );
+        break;
+    case I2C_BME280_READ_SAMPLES:
+        result = i2c_bme280_read_samples( filp, (i2c_bme280_ioctl_samples __user*)arg );
+        break;
+    case I2C_BME280_GET_CONFIG:
+        result = i2c_bme280_get_config( filp, (i2c_bme280_config __user*)arg );
+        break;
+    case I2C_BME280_SET_CONFIG:
+        result = i2c_bme280_set_config_ioctl( filp, (i2c_bme280_config __user*)arg );
+        break;
+    case I2C_BME280_GET_STATUS:
+        result = i2c_bme280_get_status( filp, (i2c_bme280_status __user*)arg );
+        break;
     default:
-        pr_warn( "unsupported command %d\n", cmd );
-        return -EINVAL;
+        pr_debug( "unsupported command %d\n", cmd );
+        result = -EINVAL;
+        break;
     }
 
-    return 0;
+    return result;
 }
 
-static int i2c_bme280_read_env_measured( struct file *filp, i2c_bme280_ioctl_param __user* param )
+// poll/select/epoll 時に呼ばれる関数
+// このファイルのサンプルバッファにデータがあれば読み出し可能
+// 定期サンプリングしていない forced/sleep mode では、バッファが空なら1回分の測定を要求する
+// 測定はワークキューで行い、サンプルが積まれたら待っているプロセスを起こす
+static __poll_t i2c_bme280_poll( struct file *filp, struct poll_table_struct *wait )
 {
-    u8 reg_press[I2C_BME280_PRESS_REG_NUM];
-    u8 reg_temp[I2C_BME280_TEMP_REG_NUM];
-    u8 reg_hum[I2C_BME280_HUM_REG_NUM];
-
-    s32 pressure;
-    s32 temperature;
-    s32 humidity;
-
     i2c_bme280_device_private* dev_info;
-    struct i2c_client* client;
-
-    dev_info = (i2c_bme280_device_private*)filp->private_data;
-    client = dev_info->client;
+    i2c_bme280_file* file;
+    __poll_t mask = 0;
 
-    // read pressure data
-    i2c_bme280_read_regs_data( client, sk_bme280_press_reg, reg_press, I2C_BME280_PRESS_REG_NUM );
-    // read temperature data
-    i2c_bme280_read_regs_data( client, sk_bme280_temp_reg, reg_temp, I2C_BME280_TEMP_REG_NUM );
-    // read humidity data
-    i2c_bme280_read_regs_data( client, sk_bme280_hum_reg, reg_hum, I2C_BME280_HUM_REG_NUM );
+    file = (i2c_bme280_file*)filp->private_data;
+    dev_info = file->dev_info;
+    poll_wait( filp, &dev_info->sample_wait, wait );
 
-    pressure = (u32)reg_press[0] << 16 | (u32)reg_press[1] << 8 | (u32)reg_press[2];
-    pressure >>= 4;
-    temperature = (u32)reg_temp[0] << 16 | (u32)reg_temp[1] << 8 | (u32)reg_temp[2];
-    temperature >>= 4;
-    humidity = (u32)reg_hum[0] << 8 | (u32)reg_hum[1];
-
-    // copy to user space
-    if( copy_to_user( (void __user*)&(param->pressure), &pressure, sizeof(pressure)) != 0 ){
-        pr_err( "%s copy_to_user pressure failed.", __func__ );
-        return -EIO;
+    // remove 済みならもう読み出せない
+    if( i2c_bme280_enter( dev_info ) != 0 ){
+        return EPOLLERR | EPOLLHUP;
     }
-    if( copy_to_user( (void __user*)&(param->temperature), &temperature, sizeof(temperature)) != 0 ){
-        pr_err( "%s copy_to_user temperature failed.", __func__ );
-        return -EIO;
+
+    if( !kfifo_is_empty( &file->sample_fifo ) ){
+        mask = EPOLLIN | EPOLLRDNORM;
     }
-    if( copy_to_user( (void __user*)&(param->humidity), &humidity, sizeof(humidity)) != 0 ){
-        pr_err( "%s copy_to_user humidity failed.", __func__ );
-        return -EIO;
+    else if( i2c_bme280_sampling_interval_us( dev_info ) == 0 ){
+        // 測定中に再度 poll されても、実行待ちの間は二重に要求しない
+        schedule_work( &dev_info->oneshot_work );
     }
 
-    return 0;
+    i2c_bme280_leave( dev_info );
+
+    return mask;
 }
 
-static int i2c_bme280_read_compensation( struct file *filp, i2c_bme280_ioctl_param __user* param )
+// mmap時に呼ばれる関数
+// 最新サンプルの共有ページ(i2c_bme280_shared_page)を読み出し専用でマップする
+// サンプルはバックグラウンドサンプリングと ioctl での測定時に更新されるので、
+// 更新を続けるにはファイルを開いたままにしておくこと
+static int i2c_bme280_mmap( struct file *filp, struct vm_area_struct *vma )
 {
-    u8 reg_t[I2C_BME280_DIGT_REG_NUM];
-    u8 reg_p[I2C_BME280_DIGP_REG_NUM];
-    u8 reg_h[I2C_BME280_DIGH_REG_NUM];
-
-    bme280_comp_temperature dig_t;
-    bme280_comp_pressure    dig_p;
-    bme280_comp_humidity    dig_h;
-
     i2c_bme280_device_private* dev_info;
-    struct i2c_client* client;
 
-    dev_info = (i2c_bme280_device_private*)filp->private_data;
-    client = dev_info->client;
+    dev_info = ((i2c_bme280_file*)filp->private_data)->dev_info;
 
-    // read temperature compensation data
-    if( i2c_bme280_read_regs_data( client, sk_bme280_temperature_comp_reg, reg_t, I2C_BME280_DIGT_REG_NUM ) != 0 ){
-        return -ENODEV;
+    if( vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE ){
+        return -EINVAL;
     }
-    // read pressure compensation data
-    if( i2c_bme280_read_regs_data( client, sk_bme280_pressure_comp_reg, reg_p, I2C_BME280_DIGP_REG_NUM ) != 0 ){
-        return -ENODEV;
+    if( vma->vm_flags & VM_WRITE ){
+        return -EPERM;
     }
-    // read humidity compensation data
-    if( i2c_bme280_read_regs_data( client, sk_bme280_humidity_comp_reg, reg_h, I2C_BME280_DIGH_REG_NUM ) != 0 ){
+    if( READ_ONCE( dev_info->removed ) ){
         return -ENODEV;
     }
+    // mprotect() で書き込み可能にされないようにする
+    vma->vm_flags &= ~VM_MAYWRITE;
 
-    // ok. format compensation data.
-    dig_t.t1 =       (u16)reg_t[0] | ((u16)reg_t[1] << 8);
-    dig_t.t2 = (s16)((u16)reg_t[2] | ((u16)reg_t[3] << 8));
-    dig_t.t3 = (s16)((u16)reg_t[4] | ((u16)reg_t[5] << 8));
-
-    dig_p.p1 =       (u16)reg_p[0] | ((u16)reg_p[1] << 8);
-    dig_p.p2 = (s16)((u16)reg_p[2] | ((u16)reg_p[3] << 8));
-    dig_p.p3 = (s16)((u16)reg_p[4] | ((u16)reg_p[5] << 8));
-    dig_p.p4 = (s16)((u16)reg_p[6] | ((u16)reg_p[7] << 8));
-    dig_p.p5 = (s16)((u16)reg_p[8] | ((u16)reg_p[9] << 8));
-    dig_p.p6 = (s16)((u16)reg_p[10] | ((u16)reg_p[11] << 8));
-    dig_p.p7 = (s16)((u16)reg_p[12] | ((u16)reg_p[13] << 8));
-    dig_p.p8 = (s16)((u16)reg_p[14] | ((u16)reg_p[15] << 8));
-    dig_p.p9 = (s16)((u16)reg_p[16] | ((u16)reg_p[17] << 8));
-
-    dig_h.h1 = reg_h[0];
-    dig_h.h2 = (s16)((u16)reg_h[1] | ((u16)reg_h[2] << 8));
-    dig_h.h3 = reg_h[3];
-    dig_h.h4 = (s16)(((u16)reg_h[4] << 4) | (u16)(reg_h[5] & 0x0F));
-    dig_h.h5 = (s16)(((u16)reg_h[5] >> 4) | ((u16)reg_h[6] << 8));
-    dig_h.h6 = reg_h[7];
+    // vm_insert_page はページの参照を取るので、デバイス削除後もマッピングは有効なまま
+    return vm_insert_page( vma, vma->vm_start, dev_info->shared_page );
+}
 
-    // copy to user space
-    if( copy_to_user( (void __user*)&(param->dig_t), &dig_t, sizeof(dig_t)) != 0 ){
-        pr_err( "%s copy_to_user dig_t failed.", __func__ );
-        return -EIO;
-    }
-    if( copy_to_user( (void __user*)&(param->dig_p), &dig_p, sizeof(dig_p)) != 0 ){
+static int i2c_bme280_read_env_measured( struct file *filp, i2c_bme280_ioctl_param __user* param )
+{
+    i2c_bme280_sample sample;
+    i2c_bme280_device_private* dev_info;
+    int result;
+
+    dev_info = ((i2c_bme280_file*)filp->private_data)->dev_info;
+
+    result = i2c_bme280_get_sample( dev_info, &sample );
+    if( result != 0 ){
+        return result;
+    }
+
+    // i2c_bme280_ioctl_param の pressure, temperature, humidity は
+    // i2c_bme280_env_raw と同じ並びなので1回でコピーする
+    BUILD_BUG_ON( offsetof(i2c_bme280_ioctl_param, temperature) - offsetof(i2c_bme280_ioctl_param, pressure) != offsetof(i2c_bme280_env_raw, temperature) );
+    BUILD_BUG_ON( offsetof(i2c_bme280_ioctl_param, humidity) - offsetof(i2c_bme280_ioctl_param, pressure) != offsetof(i2c_bme280_env_raw, humidity) );
+
+    // copy to user space
+    if( copy_to_user( (void __user*)&(param->pressure), &(sample.raw), sizeof(sample.raw)) != 0 ){
+        pr_err( "%s copy_to_user failed.", __func__ );
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int i2c_bme280_read_env_compensated( struct file *filp, i2c_bme280_env_compensated __user* param )
+{
+    i2c_bme280_sample sample;
+    i2c_bme280_device_private* dev_info;
+    int result;
+
+    dev_info = ((i2c_bme280_file*)filp->private_data)->dev_info;
+
+    result = i2c_bme280_get_sample( dev_info, &sample );
+    if( result != 0 ){
+        return result;
+    }
+
+    // copy to user space
+    if( copy_to_user( param, &(sample.comp), sizeof(sample.comp) ) != 0 ){
+        pr_err( "%s copy_to_user failed.", __func__ );
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int i2c_bme280_read_samples( struct file *filp, i2c_bme280_ioctl_samples __user* param )
+{
+    i2c_bme280_ioctl_samples req;
+    i2c_bme280_device_private* dev_info;
+    i2c_bme280_file* file;
+    unsigned int copied;
+    int result;
+
+    file = (i2c_bme280_file*)filp->private_data;
+    dev_info = file->dev_info;
+
+    if( copy_from_user( &req, param, sizeof(req) ) != 0 ){
+        return -EFAULT;
+    }
+
+    // 溜まっているサンプルを最大 count 件まとめてユーザー空間へコピー
+    // バッファの容量以上は溜まらないので、それ以上の count は切り詰める
+    req.count = min_t(u32, req.count, I2C_BME280_FIFO_DEPTH);
+    if( mutex_lock_interruptible( &file->read_lock ) != 0 ){
+        return -ERESTARTSYS;
+    }
+    result = kfifo_to_user( &file->sample_fifo, u64_to_user_ptr(req.samples),
+                            (size_t)req.count * sizeof(i2c_bme280_sample), &copied );
+    mutex_unlock( &file->read_lock );
+    if( result != 0 ){
+        return result;
+    }
+
+    req.returned = copied / sizeof(i2c_bme280_sample);
+    req.dropped  = atomic_xchg( &file->dropped, 0 );
+    i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_SAMPLES, req.returned );
+
+    // copy to user space
+    if( copy_to_user( param, &req, sizeof(req) ) != 0 ){
+        pr_err( "%s copy_to_user failed.", __func__ );
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int i2c_bme280_get_config( struct file *filp, i2c_bme280_config __user* param )
+{
+    i2c_bme280_config conf;
+    i2c_bme280_device_private* dev_info;
+
+    dev_info = ((i2c_bme280_file*)filp->private_data)->dev_info;
+
+    mutex_lock( &dev_info->config_lock );
+    conf = dev_info->config;
+    mutex_unlock( &dev_info->config_lock );
+
+    if( copy_to_user( param, &conf, sizeof(conf) ) != 0 ){
+        pr_err( "%s copy_to_user failed.", __func__ );
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int i2c_bme280_set_config_ioctl( struct file *filp, i2c_bme280_config __user* param )
+{
+    i2c_bme280_config conf;
+    i2c_bme280_device_private* dev_info;
+    int result;
+
+    dev_info = ((i2c_bme280_file*)filp->private_data)->dev_info;
+
+    if( copy_from_user( &conf, param, sizeof(conf) ) != 0 ){
+        return -EFAULT;
+    }
+
+    mutex_lock( &dev_info->config_lock );
+    result = i2c_bme280_set_config( dev_info, &conf );
+    mutex_unlock( &dev_info->config_lock );
+    if( result != 0 ){
+        return result;
+    }
+
+    return i2c_bme280_get_config( filp, param );
+}
+
+static int i2c_bme280_get_status( struct file *filp, i2c_bme280_status __user* param )
+{
+    i2c_bme280_status status;
+    i2c_bme280_device_private* dev_info;
+
+    dev_info = ((i2c_bme280_file*)filp->private_data)->dev_info;
+
+    memset( &status, 0, sizeof(status) );
+    mutex_lock( &dev_info->bus_lock );
+    status.last_error         = dev_info->last_error;
+    status.consecutive_errors = dev_info->consecutive_errors;
+    status.last_success       = dev_info->last_success;
+    mutex_unlock( &dev_info->bus_lock );
+    status.resets  = i2c_bme280_stat_read( dev_info, I2C_BME280_STAT_RESETS );
+    status.errors  = i2c_bme280_stat_read( dev_info, I2C_BME280_STAT_ERRORS );
+    status.retries = i2c_bme280_stat_read( dev_info, I2C_BME280_STAT_RETRIES );
+
+    if( copy_to_user( param, &status, sizeof(status) ) != 0 ){
+        pr_err( "%s copy_to_user failed.", __func__ );
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int i2c_bme280_read_compensation( struct file *filp, i2c_bme280_ioctl_param __user* param )
+{
+    i2c_bme280_device_private* dev_info;
+
+    dev_info = ((i2c_bme280_file*)filp->private_data)->dev_info;
+
+    // probe 時にキャッシュした校正値を返す。バスアクセスは発生しない
+    // copy to user space
+    if( copy_to_user( (void __user*)&(param->dig_t), &(dev_info->dig_t), sizeof(dev_info->dig_t)) != 0 ){
+        pr_err( "%s copy_to_user dig_t failed.", __func__ );
+        return -EIO;
+    }
+    if( copy_to_user( (void __user*)&(param->dig_p), &(dev_info->dig_p), sizeof(dev_info->dig_p)) != 0 ){
         pr_err( "%s copy_to_user dig_p failed.", __func__ );
         return -EIO;
     }
-    if( copy_to_user( (void __user*)&(param->dig_h), &dig_h, sizeof(dig_h)) != 0 ){
+    if( copy_to_user( (void __user*)&(param->dig_h), &(dev_info->dig_h), sizeof(dev_info->dig_h)) != 0 ){
         pr_err( "%s copy_to_user dig_h failed.", __func__ );
         return -EIO;
     }
@@ -499,31 +1360,853 @@ static int i2c_bme280_read_compensation( struct file *filp, i2c_bme280_ioctl_par
     return 0;
 }
 
-static int i2c_bme280_read_regs_data( struct i2c_client* client, const u8* regs, u8* dst, size_t count )
+// バックグラウンドサンプリング処理
+// i2c_bme280_sampling_interval_us() 毎に測定値を読み出してバッファへ積む
+static void i2c_bme280_sample_work( struct work_struct* work )
+{
+    i2c_bme280_device_private* dev_info;
+    unsigned long now;
+    u32 interval;
+
+    dev_info = container_of( to_delayed_work(work), i2c_bme280_device_private, sample_work );
+
+    // 定期サンプリングしない設定になっていれば止める
+    interval = i2c_bme280_sampling_interval_us( dev_info );
+    if( interval == 0 ){
+        return;
+    }
+
+    i2c_bme280_produce_sample( dev_info );
+
+    // 処理時間で周期がずれないよう、前回の予定時刻を基準に次回を決める
+    now = jiffies;
+    dev_info->next_sample += usecs_to_jiffies( interval );
+    if( time_before( dev_info->next_sample, now ) ){
+        dev_info->next_sample = now;
+    }
+    schedule_delayed_work( &dev_info->sample_work, dev_info->next_sample - now );
+}
+
+// poll() から要求された1回分の測定
+// 失敗した場合は起こさないので、次の poll() で再度要求される
+static void i2c_bme280_oneshot_work( struct work_struct* work )
+{
+    i2c_bme280_device_private* dev_info;
+
+    dev_info = container_of( work, i2c_bme280_device_private, oneshot_work );
+
+    // 要求の後で定期サンプリングに切り替わっていればそちらに任せる
+    if( i2c_bme280_sampling_interval_us( dev_info ) != 0 ){
+        return;
+    }
+    i2c_bme280_produce_sample( dev_info );
+}
+
+// 1回測定して、タイムスタンプと補正値を付けたサンプルを open 中の全ファイルのバッファへ積む
+static int i2c_bme280_produce_sample( i2c_bme280_device_private* dev_info )
+{
+    i2c_bme280_sample sample;
+    i2c_bme280_file* file;
+    int result;
+
+    mutex_lock( &dev_info->sample_lock );
+
+    result = i2c_bme280_take_sample( dev_info, &sample );
+    if( result == 0 ){
+        list_for_each_entry( file, &dev_info->files, node ){
+            // 満杯なら新しいサンプルを捨てる(古いものを捨てるには読み出し側の排他が必要なため)
+            // 読み出しの遅いファイルがあっても、他のファイルには影響しない
+            if( kfifo_put( &file->sample_fifo, sample ) == 0 ){
+                atomic_inc( &file->dropped );
+            }
+        }
+    }
+
+    mutex_unlock( &dev_info->sample_lock );
+
+    if( result == 0 ){
+        wake_up_interruptible( &dev_info->sample_wait );
+    }
+
+    return result;
+}
+
+// 1回測定してタイムスタンプと補正値を付け、最新サンプルのキャッシュを更新する
+// sample_lock を取った状態で呼ぶこと
+static int i2c_bme280_take_sample( i2c_bme280_device_private* dev_info, i2c_bme280_sample* sample )
+{
+    int result;
+
+    lockdep_assert_held( &dev_info->sample_lock );
+
+    result = i2c_bme280_measure_raw( dev_info, &(sample->raw), &(sample->flags) );
+    if( result != 0 ){
+        return result;
+    }
+
+    sample->timestamp = ktime_get_ns();
+    sample->sequence  = dev_info->sample_seq++;
+    i2c_bme280_compensate( dev_info, &(sample->raw), &(sample->comp) );
+    trace_i2c_bme280_sample( dev_info->client, sample );
+
+    write_seqlock( &dev_info->latest_lock );
+    dev_info->latest = *sample;
+    dev_info->latest_valid = true;
+    write_sequnlock( &dev_info->latest_lock );
+
+    i2c_bme280_update_shared_page( dev_info, sample );
+
+    return 0;
+}
+
+// 共有ページの最新サンプルを更新する
+// ユーザー空間の読み出し側とはロックを共有できないので sequence で書き換え中を知らせる
+static void i2c_bme280_update_shared_page( i2c_bme280_device_private* dev_info, const i2c_bme280_sample* sample )
+{
+    i2c_bme280_shared_page* page = page_address( dev_info->shared_page );
+
+    WRITE_ONCE( page->sequence, page->sequence + 1 );
+    smp_wmb();
+    page->sample = *sample;
+    smp_wmb();
+    WRITE_ONCE( page->sequence, page->sequence + 1 );
+}
+
+// キャッシュしている最新サンプルが現在の変換周期内のものなら返す
+// normal mode  : 最大測定時間 + t_sb 毎にしか測定値は更新されない
+// forced mode  : 最大測定時間内に測定したものは同時に要求したものとみなす
+// sleep mode   : 測定値は更新されないので常にキャッシュを返す
+static bool i2c_bme280_read_latest( i2c_bme280_device_private* dev_info, i2c_bme280_sample* sample )
+{
+    unsigned int seq;
+    bool valid;
+    u64 period_ns;
+
+    do {
+        seq = read_seqbegin( &dev_info->latest_lock );
+        *sample = dev_info->latest;
+        valid = dev_info->latest_valid;
+    } while( read_seqretry( &dev_info->latest_lock, seq ) );
+
+    if( !valid ){
+        return false;
+    }
+
+    switch( dev_info->config.mode ){
+    case BME280_MODE_NORMAL:
+        period_ns = (u64)(dev_info->config.meas_time_us + sk_bme280_standby_us[dev_info->config.t_sb]) * NSEC_PER_USEC;
+        break;
+    case BME280_MODE_FORCED:
+        period_ns = (u64)dev_info->config.meas_time_us * NSEC_PER_USEC;
+        break;
+    default:
+        return true;
+    }
+
+    return ktime_get_ns() - sample->timestamp < period_ns;
+}
+
+// ioctl 用に最新の測定値を返す
+// 同じ変換周期内に複数プロセスから要求されてもバスアクセスは1回にまとめる
+static int i2c_bme280_get_sample( i2c_bme280_device_private* dev_info, i2c_bme280_sample* sample )
+{
+    int result;
+
+    if( i2c_bme280_read_latest( dev_info, sample ) ){
+        i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_CACHE_HITS, 1 );
+        i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_SAMPLES, 1 );
+        return 0;
+    }
+
+    if( mutex_lock_interruptible( &dev_info->sample_lock ) != 0 ){
+        return -ERESTARTSYS;
+    }
+    // ロック待ちの間に他のプロセスが測定していればそれを使う
+    if( i2c_bme280_read_latest( dev_info, sample ) ){
+        i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_CACHE_HITS, 1 );
+        result = 0;
+    }
+    else {
+        i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_CACHE_MISSES, 1 );
+        result = i2c_bme280_take_sample( dev_info, sample );
+    }
+    mutex_unlock( &dev_info->sample_lock );
+
+    if( result == 0 ){
+        i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_SAMPLES, 1 );
+    }
+
+    return result;
+}
+
+// 設定変更後にバックグラウンドサンプリングをやり直す
+// open されていなければ次の open で開始されるので何もしない。remove 済みなら再開しない
+static void i2c_bme280_restart_sampling( i2c_bme280_device_private* dev_info )
+{
+    mutex_lock( &dev_info->open_lock );
+    if( dev_info->open_count != 0 && !dev_info->removed ){
+        dev_info->next_sample = jiffies;
+        mod_delayed_work( system_wq, &dev_info->sample_work, 0 );
+    }
+    mutex_unlock( &dev_info->open_lock );
+}
+
+// forced mode で1回測定する
+// ctrl_meas に forced mode を書き込むと1回測定してスリープに戻る。
+// 最大測定時間だけ眠ってから status の measuring ビットで完了を確認する
+static int i2c_bme280_force_measurement( i2c_bme280_device_private* dev_info )
+{
+    u32 meas_time;
+    u8 value;
+    s32 status;
+    int retry;
+
+    value     = (dev_info->config.osrs_t << 5) | (dev_info->config.osrs_p << 2) | BME280_MODE_FORCED;
+    meas_time = dev_info->config.meas_time_us;
+
+    if( i2c_bme280_write_reg( dev_info, 0xF4, value ) != 0 ){
+        pr_err( "%s write ctrl_meas failed.\n", __func__ );
+        return -ENODEV;
+    }
+
+    // データシートの最大測定時間はワーストケースなので通常はこの1回で測定が終わっている
+    usleep_range( meas_time, meas_time + meas_time / 16 + 100 );
+
+    for( retry = 0; retry < I2C_BME280_MEASURING_RETRY; ++retry ){
+        if( retry != 0 ){
+            i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_RETRIES, 1 );
+        }
+        // status(0xF3) measuring[3] = 1: 測定中
+        status = i2c_bme280_read_reg( dev_info, 0xF3 );
+        if( status < 0 ){
+            pr_err( "%s read status failed. error=%d\n", __func__, status );
+            return -ENODEV;
+        }
+        if( (status & 0x08) == 0 ){
+            return 0;
+        }
+        usleep_range( 500, 1000 );
+    }
+
+    pr_err( "%s measurement timeout.\n", __func__ );
+    return -ETIMEDOUT;
+}
+
+// 測定値レジスタを読み出して未補正の生値を返す
+// forced mode では1回測定を開始して、測定完了まで待ってから読み出す
+// 再試行しても失敗することが reset_threshold 回続いたらチップをソフトリセットする
+// flags には i2c_bme280_sample.flags に設定する値を返す
+static int i2c_bme280_measure_raw( i2c_bme280_device_private* dev_info, i2c_bme280_env_raw* raw, u32* flags )
+{
+    u8 reg_data[I2C_BME280_DATA_REG_NUM];
+    // 実行中に書き換えられても 0 で割らないよう1度だけ読む
+    unsigned int threshold = READ_ONCE( reset_threshold );
+    int result = 0;
+
+    // 測定開始から読み出しまでを1まとまりで行う
+    mutex_lock( &dev_info->bus_lock );
+
+    dev_info->bus_retried = false;
+
+    if( dev_info->config.mode == BME280_MODE_FORCED ){
+        result = i2c_bme280_force_measurement( dev_info );
+    }
+
+    // read pressure, temperature, humidity data at once
+    if( result == 0 && i2c_bme280_read_regs_data( dev_info, I2C_BME280_DATA_REG, reg_data, I2C_BME280_DATA_REG_NUM ) != 0 ){
+        result = -ENODEV;
+    }
+
+    dev_info->last_error = result;
+    if( result == 0 ){
+        *flags = (dev_info->bus_retried ? I2C_BME280_SAMPLE_RETRIED : 0) |
+                 (dev_info->bus_reset   ? I2C_BME280_SAMPLE_RESET   : 0);
+        dev_info->bus_reset = false;
+        dev_info->consecutive_errors = 0;
+        dev_info->last_success = ktime_get_ns();
+    }
+    else {
+        dev_info->consecutive_errors++;
+        // 失敗が続く場合は reset_threshold 回毎にリセットし直す
+        if( threshold != 0 && dev_info->consecutive_errors % threshold == 0 ){
+            i2c_bme280_soft_reset( dev_info );
+        }
+    }
+
+    mutex_unlock( &dev_info->bus_lock );
+
+    if( result != 0 ){
+        return result;
+    }
+
+    // reg_data[0..2] = press_msb, press_lsb, press_xlsb
+    // reg_data[3..5] = temp_msb,  temp_lsb,  temp_xlsb
+    // reg_data[6..7] = hum_msb,   hum_lsb
+    raw->pressure    = ((u32)reg_data[0] << 16 | (u32)reg_data[1] << 8 | (u32)reg_data[2]) >> 4;
+    raw->temperature = ((u32)reg_data[3] << 16 | (u32)reg_data[4] << 8 | (u32)reg_data[5]) >> 4;
+    raw->humidity    =  (u32)reg_data[6] << 8  | (u32)reg_data[7];
+
+    return 0;
+}
+
+// チップをソフトリセットして動作設定を書き込み直す。bus_lock を取った状態で呼ぶこと
+// 校正値はNVMに焼き込まれていて変わらないので読み直さない
+static int i2c_bme280_soft_reset( i2c_bme280_device_private* dev_info )
+{
+    s32 status;
+    int poll;
+    int result;
+
+    lockdep_assert_held( &dev_info->bus_lock );
+
+    pr_warn_ratelimited( "%s: i2c-%d 0x%02X\n", __func__, dev_info->client->adapter->nr, dev_info->client->addr );
+    i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_RESETS, 1 );
+    dev_info->bus_reset = true;
+
+    // reset(0xE0) に 0xB6 を書くとパワーオンリセットと同じ状態になる
+    result = i2c_bme280_write_reg( dev_info, 0xE0, 0xB6 );
+    if( result != 0 ){
+        goto RESET_BAILOUT;
+    }
+
+    // 起動時間(データシート 最大2ms)待ってから、status(0xF3) im_update[0] でNVMの読み込み完了を確認する
+    usleep_range( 2000, 3000 );
+    for( poll = 0; poll < I2C_BME280_RESET_POLL; ++poll ){
+        status = i2c_bme280_read_reg( dev_info, 0xF3 );
+        if( status >= 0 && (status & 0x01) == 0 ){
+            break;
+        }
+        usleep_range( 500, 1000 );
+    }
+    if( poll == I2C_BME280_RESET_POLL ){
+        result = -ETIMEDOUT;
+        goto RESET_BAILOUT;
+    }
+
+    result = i2c_bmc280_init_reg( dev_info->client );
+    if( result != 0 ){
+        goto RESET_BAILOUT;
+    }
+
+    trace_i2c_bme280_reset( dev_info->client, 0 );
+    return 0;
+
+RESET_BAILOUT:
+    trace_i2c_bme280_reset( dev_info->client, result );
+    pr_err_ratelimited( "%s failed. error=%d\n", __func__, result );
+    return result;
+}
+
+// 生値をキャッシュ済みの校正値で補正する
+// 計算式はデータシート記載の整数版補正式(BME280_compensate_T_int32, 
+// BME280_compensate_P_int64, bme280_compensate_H_int32)そのまま
+static void i2c_bme280_compensate( const i2c_bme280_device_private* dev_info, const i2c_bme280_env_raw* raw, i2c_bme280_env_compensated* comp )
 {
+    const bme280_comp_temperature* dig_t = &(dev_info->dig_t);
+    const bme280_comp_pressure*    dig_p = &(dev_info->dig_p);
+    const bme280_comp_humidity*    dig_h = &(dev_info->dig_h);
+    s32 t_fine;
+    s32 var1_32, var2_32;
+    s64 var1, var2, p;
+    s32 v_x1;
+
+    // temperature [0.01 degC]
+    var1_32 = ((((raw->temperature >> 3) - ((s32)dig_t->t1 << 1))) * ((s32)dig_t->t2)) >> 11;
+    var2_32 = (((((raw->temperature >> 4) - ((s32)dig_t->t1)) * ((raw->temperature >> 4) - ((s32)dig_t->t1))) >> 12) * ((s32)dig_t->t3)) >> 14;
+    t_fine = var1_32 + var2_32;
+    comp->temperature = (t_fine * 5 + 128) >> 8;
+
+    // pressure [Pa * 256]
+    var1 = ((s64)t_fine) - 128000;
+    var2 = var1 * var1 * (s64)dig_p->p6;
+    var2 = var2 + ((var1 * (s64)dig_p->p5) << 17);
+    var2 = var2 + (((s64)dig_p->p4) << 35);
+    var1 = ((var1 * var1 * (s64)dig_p->p3) >> 8) + ((var1 * (s64)dig_p->p2) << 12);
+    var1 = (((((s64)1) << 47) + var1) * ((s64)dig_p->p1)) >> 33;
+    if( var1 == 0 ){
+        // avoid exception caused by division by zero
+        comp->pressure = 0;
+    }
+    else {
+        p = 1048576 - raw->pressure;
+        p = div64_s64( ((p << 31) - var2) * 3125, var1 );
+        var1 = (((s64)dig_p->p9) * (p >> 13) * (p >> 13)) >> 25;
+        var2 = (((s64)dig_p->p8) * p) >> 19;
+        p = ((p + var1 + var2) >> 8) + (((s64)dig_p->p7) << 4);
+        comp->pressure = (u32)p;
+    }
+
+    // humidity [%RH * 1024]
+    v_x1 = t_fine - ((s32)76800);
+    v_x1 = (((((raw->humidity << 14) - (((s32)dig_h->h4) << 20) - (((s32)dig_h->h5) * v_x1)) +
+              ((s32)16384)) >> 15) * (((((((v_x1 * ((s32)dig_h->h6)) >> 10) *
+              (((v_x1 * ((s32)dig_h->h3)) >> 11) + ((s32)32768))) >> 10) + ((s32)2097152)) *
+              ((s32)dig_h->h2) + 8192) >> 14));
+    v_x1 = v_x1 - (((((v_x1 >> 15) * (v_x1 >> 15)) >> 7) * ((s32)dig_h->h1)) >> 4);
+    v_x1 = (v_x1 < 0 ? 0 : v_x1);
+    v_x1 = (v_x1 > 419430400 ? 419430400 : v_x1);
+    comp->humidity = (u32)(v_x1 >> 12);
+}
+
+// 校正値を読み出して dev_info に格納する。probe 時に1度だけ呼ぶこと
+static int i2c_bme280_load_compensation( i2c_bme280_device_private* dev_info )
+{
+    u8 reg_c[I2C_BME280_CALIB00_REG_NUM];
+    u8 reg_h[I2C_BME280_CALIB26_REG_NUM];
+
+    bme280_comp_temperature* dig_t;
+    bme280_comp_pressure*    dig_p;
+    bme280_comp_humidity*    dig_h;
+
+    dig_t = &(dev_info->dig_t);
+    dig_p = &(dev_info->dig_p);
+    dig_h = &(dev_info->dig_h);
+
+    // read temperature, pressure and dig_H1 compensation data
+    if( i2c_bme280_read_regs_data( dev_info, I2C_BME280_CALIB00_REG, reg_c, I2C_BME280_CALIB00_REG_NUM ) != 0 ){
+        return -ENODEV;
+    }
+    // read humidity compensation data
+    if( i2c_bme280_read_regs_data( dev_info, I2C_BME280_CALIB26_REG, reg_h, I2C_BME280_CALIB26_REG_NUM ) != 0 ){
+        return -ENODEV;
+    }
+
+    // ok. format compensation data.
+    dig_t->t1 =       (u16)reg_c[0] | ((u16)reg_c[1] << 8);
+    dig_t->t2 = (s16)((u16)reg_c[2] | ((u16)reg_c[3] << 8));
+    dig_t->t3 = (s16)((u16)reg_c[4] | ((u16)reg_c[5] << 8));
+
+    dig_p->p1 =       (u16)reg_c[6] | ((u16)reg_c[7] << 8);
+    dig_p->p2 = (s16)((u16)reg_c[8] | ((u16)reg_c[9] << 8));
+    dig_p->p3 = (s16)((u16)reg_c[10] | ((u16)reg_c[11] << 8));
+    dig_p->p4 = (s16)((u16)reg_c[12] | ((u16)reg_c[13] << 8));
+    dig_p->p5 = (s16)((u16)reg_c[14] | ((u16)reg_c[15] << 8));
+    dig_p->p6 = (s16)((u16)reg_c[16] | ((u16)reg_c[17] << 8));
+    dig_p->p7 = (s16)((u16)reg_c[18] | ((u16)reg_c[19] << 8));
+    dig_p->p8 = (s16)((u16)reg_c[20] | ((u16)reg_c[21] << 8));
+    dig_p->p9 = (s16)((u16)reg_c[22] | ((u16)reg_c[23] << 8));
+
+    // reg_c[24] = 0xA0 は未使用
+    dig_h->h1 = reg_c[25];
+    dig_h->h2 = (s16)((u16)reg_h[0] | ((u16)reg_h[1] << 8));
+    dig_h->h3 = reg_h[2];
+    dig_h->h4 = (s16)(((u16)reg_h[3] << 4) | (u16)(reg_h[4] & 0x0F));
+    dig_h->h5 = (s16)(((u16)reg_h[4] >> 4) | ((u16)reg_h[5] << 4));
+    dig_h->h6 = reg_h[6];
+
+    return 0;
+}
+
+// 連続したレジスタ [reg, reg + count) を読み出す
+// アダプタがI2Cブロック読み出しに対応していれば1トランザクションで読み出す。
+// 非対応のアダプタでは従来通り1バイトずつ読み出す
+static int i2c_bme280_read_regs_data( i2c_bme280_device_private* dev_info, u8 reg, u8* dst, size_t count )
+{
+    struct i2c_client* client = dev_info->client;
+    u64 start = ktime_get_ns();
     s32 result;
     int i;
 
+    if( count <= I2C_SMBUS_BLOCK_MAX && i2c_check_functionality( client->adapter, I2C_FUNC_SMBUS_READ_I2C_BLOCK ) ){
+        for( i = 0; ; ++i ){
+            result = i2c_smbus_read_i2c_block_data( client, reg, count, dst );
+            trace_i2c_bme280_read_regs( client, reg, count, ktime_get_ns() - start, result );
+            i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_TRANSACTIONS, 1 );
+            if( result == count ){
+                break;
+            }
+            i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_ERRORS, 1 );
+            if( i >= bus_retries ){
+                pr_err_ratelimited( "%s i2c_smbus_read_i2c_block_data() failed. reg=0x%02X, count=%zu, result=%d\n", __func__, reg, count, result );
+                return -ENODEV;
+            }
+            i2c_bme280_retry_backoff( dev_info, i );
+        }
+        i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_BYTES, count );
+        i2c_bme280_stat_latency( dev_info, I2C_BME280_HIST_BUS, start );
+
+        return 0;
+    }
+
     for( i = 0; i < count; ++i ){
-        result = i2c_smbus_read_byte_data( client, regs[i] );
+        result = i2c_bme280_read_reg( dev_info, reg + i );
         
         if( result < 0 ){
-            pr_err( "%s i2c_smbus_read_byte_data() failed. reg=0x%02X, error=%d\n", __func__, regs[i], result );
+            pr_err_ratelimited( "%s i2c_smbus_read_byte_data() failed. reg=0x%02X, error=%d\n", __func__, reg + i, result );
             return -ENODEV;
         }
 
         dst[i] = result;
     }
+    i2c_bme280_stat_latency( dev_info, I2C_BME280_HIST_BUS, start );
+
+    return 0;
+}
+
+// 1バイト読み出し。失敗したら bus_retries 回まで再試行する
+static s32 i2c_bme280_read_reg( i2c_bme280_device_private* dev_info, u8 reg )
+{
+    u64 start = ktime_get_ns();
+    unsigned int attempt;
+    s32 result;
+
+    for( attempt = 0; ; ++attempt ){
+        result = i2c_smbus_read_byte_data( dev_info->client, reg );
+        trace_i2c_bme280_read_regs( dev_info->client, reg, 1, ktime_get_ns() - start, result );
+        i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_TRANSACTIONS, 1 );
+        if( result >= 0 ){
+            i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_BYTES, 1 );
+            return result;
+        }
+        i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_ERRORS, 1 );
+        if( attempt >= bus_retries ){
+            return result;
+        }
+        i2c_bme280_retry_backoff( dev_info, attempt );
+    }
+}
+
+// 1バイト書き込み。失敗したら bus_retries 回まで再試行する
+static s32 i2c_bme280_write_reg( i2c_bme280_device_private* dev_info, u8 reg, u8 value )
+{
+    unsigned int attempt;
+    s32 result;
+
+    for( attempt = 0; ; ++attempt ){
+        result = i2c_smbus_write_byte_data( dev_info->client, reg, value );
+        trace_i2c_bme280_write_reg( dev_info->client, reg, value, result );
+        i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_TRANSACTIONS, 1 );
+        if( result >= 0 ){
+            i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_BYTES, 1 );
+            return result;
+        }
+        i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_ERRORS, 1 );
+        if( attempt >= bus_retries ){
+            return result;
+        }
+        i2c_bme280_retry_backoff( dev_info, attempt );
+    }
+}
+
+// attempt 回目の失敗後、再試行する前に待つ
+// 待ち時間は bus_retry_delay_us から倍々に増やし、I2C_BME280_RETRY_DELAY_MAX_US で頭打ちにする
+static void i2c_bme280_retry_backoff( i2c_bme280_device_private* dev_info, unsigned int attempt )
+{
+    u32 delay = min_t(u64, (u64)bus_retry_delay_us << min_t(unsigned int, attempt, 16), I2C_BME280_RETRY_DELAY_MAX_US);
+
+    i2c_bme280_stat_add( dev_info, I2C_BME280_STAT_RETRIES, 1 );
+    dev_info->bus_retried = true;
+    if( delay != 0 ){
+        usleep_range( delay, delay + delay / 2 );
+    }
+}
+
+//
+// 性能カウンタ
+// /sys/kernel/debug/i2c_bme280/<bus>-<addr>/stats でヒストグラムを含めた全カウンタを読める
+//
+
+static void i2c_bme280_stat_add( i2c_bme280_device_private* dev_info, int stat, u64 value )
+{
+    this_cpu_add( dev_info->stats->count[stat], value );
+}
+
+// start_ns からの経過時間をヒストグラムに加える
+static void i2c_bme280_stat_latency( i2c_bme280_device_private* dev_info, int hist, u64 start_ns )
+{
+    u64 elapsed_us = div_u64( ktime_get_ns() - start_ns, NSEC_PER_USEC );
+    int bucket = min_t(int, fls64( elapsed_us ), I2C_BME280_HIST_BUCKETS - 1);
+
+    this_cpu_inc( dev_info->stats->hist[hist][bucket] );
+}
+
+static u64 i2c_bme280_stat_read( const i2c_bme280_device_private* dev_info, int stat )
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu( cpu ){
+        sum += per_cpu_ptr( dev_info->stats, cpu )->count[stat];
+    }
+
+    return sum;
+}
+
+static u64 i2c_bme280_stat_read_hist( const i2c_bme280_device_private* dev_info, int hist, int bucket )
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu( cpu ){
+        sum += per_cpu_ptr( dev_info->stats, cpu )->hist[hist][bucket];
+    }
+
+    return sum;
+}
+
+static int i2c_bme280_stats_show( struct seq_file* s, void* unused )
+{
+    static const char* const stat_name[I2C_BME280_STAT_NUM] = {
+        "samples", "transactions", "bytes", "errors", "retries", "cache_hits", "cache_misses", "resets",
+    };
+    static const char* const hist_name[I2C_BME280_HIST_NUM] = {
+        "bus_read", "ioctl",
+    };
+    i2c_bme280_device_private* dev_info = s->private;
+    int stat;
+    int hist;
+    int bucket;
+
+    for( stat = 0; stat < I2C_BME280_STAT_NUM; ++stat ){
+        seq_printf( s, "%-16s %llu\n", stat_name[stat], i2c_bme280_stat_read( dev_info, stat ) );
+    }
+
+    // "<2^n us 未満> <回数>" の形式で、回数が 0 のバケットは省略する
+    for( hist = 0; hist < I2C_BME280_HIST_NUM; ++hist ){
+        seq_printf( s, "\n%s latency [us]\n", hist_name[hist] );
+        for( bucket = 0; bucket < I2C_BME280_HIST_BUCKETS; ++bucket ){
+            u64 count = i2c_bme280_stat_read_hist( dev_info, hist, bucket );
+            if( count == 0 ){
+                continue;
+            }
+            if( bucket == I2C_BME280_HIST_BUCKETS - 1 ){
+                seq_printf( s, "  >=%-10llu %llu\n", 1ULL << (bucket - 1), count );
+            }
+            else {
+                seq_printf( s, "  <%-11llu %llu\n", 1ULL << bucket, count );
+            }
+        }
+    }
 
     return 0;
 }
+DEFINE_SHOW_ATTRIBUTE( i2c_bme280_stats );
+
+// debugfs はデバッグ用なので作成に失敗しても probe は失敗させない
+static void i2c_bme280_debugfs_create( i2c_bme280_device_private* dev_info )
+{
+    dev_info->debugfs = debugfs_create_dir( dev_name( &dev_info->client->dev ), s_bme280_debugfs_root );
+    debugfs_create_file( "stats", 0444, dev_info->debugfs, dev_info, &i2c_bme280_stats_fops );
+}
+
+//
+// IIO backend
+// /sys/bus/iio/devices/iio:deviceN から補正済みの値を読み出せる
+// iio-trig-hrtimer などのトリガーを割り当てると /dev/iio:deviceN へ連続してサンプルを流す
+//
+#ifdef I2C_BME280_USE_IIO
+
+typedef struct
+{
+    i2c_bme280_device_private* dev_info;
+} i2c_bme280_iio_private;
+
+#define I2C_BME280_IIO_CHANNEL( _type, _index, _sign )                                           \
+    {                                                                                           \
+        .type = (_type),                                                                        \
+        .info_mask_separate = BIT(IIO_CHAN_INFO_RAW) | BIT(IIO_CHAN_INFO_SCALE) | BIT(IIO_CHAN_INFO_OFFSET), \
+        .scan_index = (_index),                                                                 \
+        .scan_type = {                                                                          \
+            .sign = (_sign),                                                                    \
+            .realbits = 32,                                                                     \
+            .storagebits = 32,                                                                  \
+            .endianness = IIO_CPU,                                                              \
+        },                                                                                      \
+    }
+
+// raw には i2c_bme280_env_compensated の値をそのまま返す
+static const struct iio_chan_spec sk_bme280_iio_channels[] = {
+    I2C_BME280_IIO_CHANNEL( IIO_TEMP,             0, 's' ),
+    I2C_BME280_IIO_CHANNEL( IIO_PRESSURE,         1, 'u' ),
+    I2C_BME280_IIO_CHANNEL( IIO_HUMIDITYRELATIVE, 2, 'u' ),
+    IIO_CHAN_SOFT_TIMESTAMP( 3 ),
+};
+
+static int i2c_bme280_iio_read_raw( struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+                                    int *val, int *val2, long mask )
+{
+    i2c_bme280_iio_private* priv = iio_priv( indio_dev );
+    i2c_bme280_sample sample;
+    int result;
+
+    switch( mask ){
+    case IIO_CHAN_INFO_RAW:
+        // キャッシュが有効ならバスにアクセスしない
+        result = i2c_bme280_get_sample( priv->dev_info, &sample );
+        if( result != 0 ){
+            return result;
+        }
+        switch( chan->type ){
+        case IIO_TEMP:
+            *val = sample.comp.temperature;
+            return IIO_VAL_INT;
+        case IIO_PRESSURE:
+            *val = sample.comp.pressure;
+            return IIO_VAL_INT;
+        case IIO_HUMIDITYRELATIVE:
+            *val = sample.comp.humidity;
+            return IIO_VAL_INT;
+        default:
+            return -EINVAL;
+        }
+
+    case IIO_CHAN_INFO_SCALE:
+        // IIOの単位へ変換する倍率
+        switch( chan->type ){
+        case IIO_TEMP:
+            // 0.01 degC -> milli degC
+            *val = 10;
+            return IIO_VAL_INT;
+        case IIO_PRESSURE:
+            // Pa * 256 -> kPa
+            *val  = 1;
+            *val2 = 256 * 1000;
+            return IIO_VAL_FRACTIONAL;
+        case IIO_HUMIDITYRELATIVE:
+            // %RH * 1024 -> milli %RH
+            *val  = 1000;
+            *val2 = 1024;
+            return IIO_VAL_FRACTIONAL;
+        default:
+            return -EINVAL;
+        }
+
+    case IIO_CHAN_INFO_OFFSET:
+        // 補正済みの値なのでオフセットは無い
+        *val = 0;
+        return IIO_VAL_INT;
+
+    default:
+        return -EINVAL;
+    }
+}
+
+static const struct iio_info sk_bme280_iio_info = {
+    .read_raw = i2c_bme280_iio_read_raw,
+};
+
+// トリガー発生時に呼ばれる関数。有効なチャンネルの値をIIOバッファに積む
+static irqreturn_t i2c_bme280_iio_trigger_handler( int irq, void *p )
+{
+    struct iio_poll_func *pf = p;
+    struct iio_dev *indio_dev = pf->indio_dev;
+    i2c_bme280_iio_private* priv = iio_priv( indio_dev );
+    i2c_bme280_sample sample;
+    s32 values[3];
+    // 有効なチャンネルの値を詰めて並べ、最後に8byte境界でタイムスタンプを置く
+    struct {
+        s32 channels[3];
+        s64 timestamp __aligned(8);
+    } scan;
+    int bit;
+    int i = 0;
+
+    if( i2c_bme280_get_sample( priv->dev_info, &sample ) == 0 ){
+        values[0] = sample.comp.temperature;
+        values[1] = sample.comp.pressure;
+        values[2] = sample.comp.humidity;
+
+        memset( &scan, 0, sizeof(scan) );
+        for_each_set_bit( bit, indio_dev->active_scan_mask, indio_dev->masklength ){
+            if( bit < ARRAY_SIZE(values) ){
+                scan.channels[i++] = values[bit];
+            }
+        }
+        iio_push_to_buffers_with_timestamp( indio_dev, &scan, pf->timestamp );
+    }
+
+    iio_trigger_notify_done( indio_dev->trig );
+
+    return IRQ_HANDLED;
+}
+
+static int i2c_bme280_iio_register( i2c_bme280_device_private* dev_info )
+{
+    struct device* dev = &dev_info->client->dev;
+    struct iio_dev* indio_dev;
+    i2c_bme280_iio_private* priv;
+    int result;
+
+    indio_dev = devm_iio_device_alloc( dev, sizeof(i2c_bme280_iio_private) );
+    if( indio_dev == NULL ){
+        return -ENOMEM;
+    }
+
+    priv = iio_priv( indio_dev );
+    priv->dev_info = dev_info;
+
+    indio_dev->dev.parent   = dev;
+    indio_dev->name         = DRIVER_NAME;
+    indio_dev->info         = &sk_bme280_iio_info;
+    indio_dev->channels     = sk_bme280_iio_channels;
+    indio_dev->num_channels = ARRAY_SIZE(sk_bme280_iio_channels);
+    indio_dev->modes        = INDIO_DIRECT_MODE;
+
+    result = devm_iio_triggered_buffer_setup( dev, indio_dev, iio_pollfunc_store_time,
+                                              i2c_bme280_iio_trigger_handler, NULL );
+    if( result != 0 ){
+        pr_err( "%s failed. devm_iio_triggered_buffer_setup = %d\n", __func__, result );
+        return result;
+    }
+
+    result = devm_iio_device_register( dev, indio_dev );
+    if( result != 0 ){
+        pr_err( "%s failed. devm_iio_device_register = %d\n", __func__, result );
+        return result;
+    }
+
+    return 0;
+}
+
+#else   // I2C_BME280_USE_IIO
+
+static int i2c_bme280_iio_register( i2c_bme280_device_private* dev_info )
+{
+    return 0;
+}
+
+#endif  // I2C_BME280_USE_IIO
 
 static int __init i2c_bme280_init(void)
 {
+    int result = 0;
     pr_info( "i2c_bme280 device driver initialization.\n" );
 
-    i2c_add_driver( &i2c_bme280_driver );
+    // 空いているメジャー番号と、全デバイス分のマイナー番号を確保
+    result = alloc_chrdev_region( &s_alloced_dev_region, MINOR_BASE, I2C_BANK, DRIVER_NAME );
+    if( result < 0 ){
+        pr_err( "%s failed. alloc_chrdev_region = %d\n", __func__, result );
+        goto REGION_ERR;
+    }
+
+    // デバイスクラス登録  /sys/class に見えるようになる
+    s_bme280_class = class_create( THIS_MODULE, DRIVER_CLASS );
+    if( IS_ERR(s_bme280_class) ){
+        result = PTR_ERR( s_bme280_class );
+        pr_err( "%s failed. class_create = %d\n", __func__, result );
+        goto CREATE_CLASS_ERR;
+    }
+
+    // デバイス毎の性能カウンタを置く debugfs ディレクトリ
+    s_bme280_debugfs_root = debugfs_create_dir( DRIVER_NAME, NULL );
+
+    // I2Cドライバ登録。対応するデバイス毎に probe が呼ばれる
+    result = i2c_add_driver( &i2c_bme280_driver );
+    if( result != 0 ){
+        pr_err( "%s failed. i2c_add_driver = %d\n", __func__, result );
+        goto ADD_DRIVER_ERR;
+    }
+
     return 0;
+
+    // error bailout
+ADD_DRIVER_ERR:
+    debugfs_remove_recursive( s_bme280_debugfs_root );
+    class_destroy( s_bme280_class );
+CREATE_CLASS_ERR:
+    unregister_chrdev_region( s_alloced_dev_region, I2C_BANK );
+REGION_ERR:
+    return result;
 }
 
 static void __exit i2c_bme280_exit(void)
@@ -531,6 +2214,12 @@ static void __exit i2c_bme280_exit(void)
     pr_info( "i2c_bme280 device driver exit.\n" );
 
     i2c_del_driver( &i2c_bme280_driver );
+    debugfs_remove_recursive( s_bme280_debugfs_root );
+    // デバイスのクラス登録を削除
+    class_destroy( s_bme280_class );
+    // デバイスが使用していたデバイス番号の登録削除
+    unregister_chrdev_region( s_alloced_dev_region, I2C_BANK );
+    idr_destroy( &s_bme280_minor_idr );
 }
 
 module_init(i2c_bme280_init);
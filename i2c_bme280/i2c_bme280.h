@@ -44,6 +44,88 @@ typedef struct i2c_bme280_ioctl_param_t
     bme280_comp_humidity    dig_h;
 } i2c_bme280_ioctl_param;
 
+// 未補正の測定値(ADC生値)
+typedef struct i2c_bme280_env_raw_t
+{
+    int32_t pressure;       // 20bit
+    int32_t temperature;    // 20bit
+    int32_t humidity;       // 16bit
+} i2c_bme280_env_raw;
+
+// 補正済み測定値。浮動小数点を使わないよう固定小数点の整数で表す
+typedef struct i2c_bme280_env_compensated_t
+{
+    int32_t  temperature;   // 0.01 degC    例: 5123 = 51.23 degC
+    uint32_t pressure;      // Pa * 256     例: 24674867 = 96386.2 Pa
+    uint32_t humidity;      // %RH * 1024   例: 47445 = 46.333 %RH
+} i2c_bme280_env_compensated;
+
+// ドライバのバックグラウンドサンプリングで生成される測定レコード
+// read() はこのレコード単位でドライバ内のバッファから読み出す
+typedef struct i2c_bme280_sample_t
+{
+    uint64_t timestamp;     // 測定時刻 [ns] (CLOCK_MONOTONIC)
+    uint32_t sequence;      // 測定毎の通し番号。read() で読む列の欠番は、バッファ溢れか ioctl などによる単発の測定
+    uint32_t flags;         // I2C_BME280_SAMPLE_*
+    i2c_bme280_env_raw          raw;
+    i2c_bme280_env_compensated  comp;
+} i2c_bme280_sample;
+
+// i2c_bme280_sample.flags
+#define I2C_BME280_SAMPLE_RETRIED   0x00000001  // バスエラーを再試行して得たサンプル
+#define I2C_BME280_SAMPLE_RESET     0x00000002  // ソフトリセットで復旧した後の最初のサンプル
+
+// mmap() で読み出し専用に共有する最新サンプルのページ
+// ドライバは sequence を奇数にしてから sample を書き換え、書き終わったら偶数に戻す
+// 読み出し側は i2c_bme280_read_shared_page() を使うこと
+typedef struct i2c_bme280_shared_page_t
+{
+    uint32_t sequence;
+    uint32_t reserved;
+    i2c_bme280_sample sample;   // sample.timestamp は CLOCK_MONOTONIC
+} i2c_bme280_shared_page;
+
+// I2C_BME280_READ_SAMPLES 用パラメータ
+typedef struct i2c_bme280_ioctl_samples_t
+{
+    uint64_t samples;       // [in]  i2c_bme280_sample 配列の先頭アドレス
+    uint32_t count;         // [in]  配列の要素数
+    uint32_t returned;      // [out] 配列に格納したサンプル数
+    uint32_t dropped;       // [out] 前回の呼び出し以降にこのファイルのバッファ溢れで捨てられたサンプル数
+    uint32_t reserved;
+} i2c_bme280_ioctl_samples;
+
+// 動作モード(ctrl_meas mode[1:0])
+#define BME280_MODE_SLEEP   0
+#define BME280_MODE_FORCED  1
+#define BME280_MODE_NORMAL  3
+
+// 動作設定。meas_time_us 以外はレジスタ設定値そのもの
+typedef struct i2c_bme280_config_t
+{
+    uint8_t  osrs_t;        // 温度オーバーサンプリング  0:skip 1:x1 2:x2 3:x4 4:x8 5:x16
+    uint8_t  osrs_p;        // 気圧オーバーサンプリング  0:skip 1:x1 2:x2 3:x4 4:x8 5:x16
+    uint8_t  osrs_h;        // 湿度オーバーサンプリング  0:skip 1:x1 2:x2 3:x4 4:x8 5:x16
+    uint8_t  filter;        // IIRフィルタ係数  0:off 1:2 2:4 3:8 4:16
+    uint8_t  t_sb;          // normal mode のスタンバイ時間
+                            // 0:0.5ms 1:62.5ms 2:125ms 3:250ms 4:500ms 5:1000ms 6:10ms 7:20ms
+    uint8_t  mode;          // BME280_MODE_*
+    uint16_t reserved;
+    uint32_t meas_time_us;  // [out] データシート記載の最大測定時間 [us]
+} i2c_bme280_config;
+
+// バスの状態
+typedef struct i2c_bme280_status_t
+{
+    int32_t  last_error;            // 最後の測定の結果。0:成功 負:エラー番号
+    uint32_t consecutive_errors;    // 連続して失敗した測定の数
+    uint32_t resets;                // エラーからの復旧でソフトリセットした回数
+    uint32_t reserved;
+    uint64_t errors;                // 失敗したI2Cトランザクションの累計
+    uint64_t retries;               // 再試行の累計
+    uint64_t last_success;          // 最後に測定に成功した時刻 [ns] (CLOCK_MONOTONIC)。0:未測定
+} i2c_bme280_status;
+
 
 #define BME280_IOC_TYPE 'M'
 // ioctl コマンド
@@ -55,5 +137,46 @@ typedef struct i2c_bme280_ioctl_param_t
 // 2:   校正データ読み取り
 //      compensation_* に校正値を読み取り。この校正値を使って環境測定データの読み取りを行うこと
 #define I2C_BME280_READ_COMPENSATION    _IOR(BME280_IOC_TYPE, 2, i2c_bme280_ioctl_param)
+// 3:   補正済み環境測定データ読み取り
+//      ドライバ内でキャッシュ済みの校正値を使って補正した値を返す
+//      read() ではバックグラウンドで測定済みの i2c_bme280_sample をまとめて読み出せる
+#define I2C_BME280_READ_ENV_COMPENSATED _IOR(BME280_IOC_TYPE, 3, i2c_bme280_env_compensated)
+// 4:   測定済みサンプルの一括読み取り
+//      バックグラウンドで測定済みの i2c_bme280_sample を最大 count 件、古い順に samples へ格納する
+//      サンプルが無ければ待たずに returned = 0 で返る
+//      サンプルバッファは open したファイル毎にあり、各ファイルで open 以降の全サンプルを読める
+//      read() と同じバッファから取り出すので、同じファイルで両方を使うとサンプルは分かれる
+#define I2C_BME280_READ_SAMPLES         _IOWR(BME280_IOC_TYPE, 4, i2c_bme280_ioctl_samples)
+// 5:   動作設定の読み取り
+#define I2C_BME280_GET_CONFIG           _IOR(BME280_IOC_TYPE, 5, i2c_bme280_config)
+// 6:   動作設定の変更
+//      全項目を検証した上でまとめて反映する。不正な値があれば -EINVAL で何も変更しない
+//      反映後の設定(meas_time_us を含む)を書き戻す
+#define I2C_BME280_SET_CONFIG           _IOWR(BME280_IOC_TYPE, 6, i2c_bme280_config)
+// 7:   バスの状態の読み取り
+//      測定の失敗は再試行とソフトリセットで自動的に復旧を試みる。その経過をここで確認できる
+#define I2C_BME280_GET_STATUS           _IOR(BME280_IOC_TYPE, 7, i2c_bme280_status)
+
+#ifndef __KERNEL__
+// mmap() した共有ページから、書き換え途中でない一貫したサンプルを読み出す
+// システムコールもバスアクセスも発生しない
+static inline void i2c_bme280_read_shared_page( const i2c_bme280_shared_page* page, i2c_bme280_sample* sample )
+{
+    uint32_t sequence;
+
+    for( ;; ){
+        sequence = __atomic_load_n( &page->sequence, __ATOMIC_ACQUIRE );
+        if( sequence & 1 ){
+            // 書き換え中
+            continue;
+        }
+        *sample = page->sample;
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+        if( __atomic_load_n( &page->sequence, __ATOMIC_RELAXED ) == sequence ){
+            return;
+        }
+    }
+}
+#endif
 
 #endif      // I2C_BME280_H_INCLUDED
\ No newline at end of file
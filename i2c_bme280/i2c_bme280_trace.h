@@ -0,0 +1,175 @@
+// i2c_bme280 のトレースポイント
+// /sys/kernel/tracing/events/i2c_bme280/ 以下で有効にするか、perf/trace-cmd で -e i2c_bme280:* を指定する
+// 無効な間はほぼコストが無いので、負荷をかけた状態での解析にはログではなくこちらを使う
+//
+// i2c_bme280.h (i2c_bme280_sample) を先に include しておくこと
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM i2c_bme280
+
+#if !defined(I2C_BME280_TRACE_H_INCLUDED) || defined(TRACE_HEADER_MULTI_READ)
+#define I2C_BME280_TRACE_H_INCLUDED
+
+#include <linux/tracepoint.h>
+#include <linux/i2c.h>
+
+// probe でチップIDを読んだ
+TRACE_EVENT( i2c_bme280_probe,
+    TP_PROTO( const struct i2c_client* client, int chipid ),
+    TP_ARGS( client, chipid ),
+    TP_STRUCT__entry(
+        __field( int, adapter_nr )
+        __field( u16, addr )
+        __field( int, chipid )
+    ),
+    TP_fast_assign(
+        __entry->adapter_nr = client->adapter->nr;
+        __entry->addr       = client->addr;
+        __entry->chipid     = chipid;
+    ),
+    TP_printk( "i2c-%d a=0x%02x chipid=0x%02x",
+               __entry->adapter_nr, __entry->addr, __entry->chipid )
+);
+
+// レジスタ1バイト書き込み
+TRACE_EVENT( i2c_bme280_write_reg,
+    TP_PROTO( const struct i2c_client* client, u8 reg, u8 value, int result ),
+    TP_ARGS( client, reg, value, result ),
+    TP_STRUCT__entry(
+        __field( int, adapter_nr )
+        __field( u16, addr )
+        __field( u8,  reg )
+        __field( u8,  value )
+        __field( int, result )
+    ),
+    TP_fast_assign(
+        __entry->adapter_nr = client->adapter->nr;
+        __entry->addr       = client->addr;
+        __entry->reg        = reg;
+        __entry->value      = value;
+        __entry->result     = result;
+    ),
+    TP_printk( "i2c-%d a=0x%02x reg=0x%02x value=0x%02x result=%d",
+               __entry->adapter_nr, __entry->addr, __entry->reg, __entry->value, __entry->result )
+);
+
+// レジスタ読み出し1トランザクション [reg, reg + len)
+TRACE_EVENT( i2c_bme280_read_regs,
+    TP_PROTO( const struct i2c_client* client, u8 reg, u8 len, u64 duration_ns, int result ),
+    TP_ARGS( client, reg, len, duration_ns, result ),
+    TP_STRUCT__entry(
+        __field( int, adapter_nr )
+        __field( u16, addr )
+        __field( u8,  reg )
+        __field( u8,  len )
+        __field( u64, duration_ns )
+        __field( int, result )
+    ),
+    TP_fast_assign(
+        __entry->adapter_nr  = client->adapter->nr;
+        __entry->addr        = client->addr;
+        __entry->reg         = reg;
+        __entry->len         = len;
+        __entry->duration_ns = duration_ns;
+        __entry->result      = result;
+    ),
+    TP_printk( "i2c-%d a=0x%02x reg=0x%02x len=%u duration=%lluns result=%d",
+               __entry->adapter_nr, __entry->addr, __entry->reg, __entry->len,
+               __entry->duration_ns, __entry->result )
+);
+
+// 測定して補正したサンプル
+TRACE_EVENT( i2c_bme280_sample,
+    TP_PROTO( const struct i2c_client* client, const i2c_bme280_sample* sample ),
+    TP_ARGS( client, sample ),
+    TP_STRUCT__entry(
+        __field( int, adapter_nr )
+        __field( u16, addr )
+        __field( u64, timestamp )
+        __field( s32, raw_pressure )
+        __field( s32, raw_temperature )
+        __field( s32, raw_humidity )
+        __field( s32, temperature )
+        __field( u32, pressure )
+        __field( u32, humidity )
+    ),
+    TP_fast_assign(
+        __entry->adapter_nr      = client->adapter->nr;
+        __entry->addr            = client->addr;
+        __entry->timestamp       = sample->timestamp;
+        __entry->raw_pressure    = sample->raw.pressure;
+        __entry->raw_temperature = sample->raw.temperature;
+        __entry->raw_humidity    = sample->raw.humidity;
+        __entry->temperature     = sample->comp.temperature;
+        __entry->pressure        = sample->comp.pressure;
+        __entry->humidity        = sample->comp.humidity;
+    ),
+    TP_printk( "i2c-%d a=0x%02x ts=%llu raw=%d,%d,%d temperature=%d pressure=%u humidity=%u",
+               __entry->adapter_nr, __entry->addr, __entry->timestamp,
+               __entry->raw_pressure, __entry->raw_temperature, __entry->raw_humidity,
+               __entry->temperature, __entry->pressure, __entry->humidity )
+);
+
+// エラーからの復旧のためのソフトリセット
+TRACE_EVENT( i2c_bme280_reset,
+    TP_PROTO( const struct i2c_client* client, int result ),
+    TP_ARGS( client, result ),
+    TP_STRUCT__entry(
+        __field( int, adapter_nr )
+        __field( u16, addr )
+        __field( int, result )
+    ),
+    TP_fast_assign(
+        __entry->adapter_nr = client->adapter->nr;
+        __entry->addr       = client->addr;
+        __entry->result     = result;
+    ),
+    TP_printk( "i2c-%d a=0x%02x result=%d",
+               __entry->adapter_nr, __entry->addr, __entry->result )
+);
+
+TRACE_EVENT( i2c_bme280_ioctl_enter,
+    TP_PROTO( const struct i2c_client* client, unsigned int cmd ),
+    TP_ARGS( client, cmd ),
+    TP_STRUCT__entry(
+        __field( int,          adapter_nr )
+        __field( u16,          addr )
+        __field( unsigned int, cmd )
+    ),
+    TP_fast_assign(
+        __entry->adapter_nr = client->adapter->nr;
+        __entry->addr       = client->addr;
+        __entry->cmd        = cmd;
+    ),
+    TP_printk( "i2c-%d a=0x%02x cmd=%u",
+               __entry->adapter_nr, __entry->addr, _IOC_NR(__entry->cmd) )
+);
+
+TRACE_EVENT( i2c_bme280_ioctl_exit,
+    TP_PROTO( const struct i2c_client* client, unsigned int cmd, long result ),
+    TP_ARGS( client, cmd, result ),
+    TP_STRUCT__entry(
+        __field( int,          adapter_nr )
+        __field( u16,          addr )
+        __field( unsigned int, cmd )
+        __field( long,         result )
+    ),
+    TP_fast_assign(
+        __entry->adapter_nr = client->adapter->nr;
+        __entry->addr       = client->addr;
+        __entry->cmd        = cmd;
+        __entry->result     = result;
+    ),
+    TP_printk( "i2c-%d a=0x%02x cmd=%u result=%ld",
+               __entry->adapter_nr, __entry->addr, _IOC_NR(__entry->cmd), __entry->result )
+);
+
+#endif      // I2C_BME280_TRACE_H_INCLUDED
+
+// define_trace.h から読み直すため、このファイルの場所を教える
+// Makefile で -I$(src) を指定している
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE i2c_bme280_trace
+#include <trace/define_trace.h>
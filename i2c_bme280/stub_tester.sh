@@ -0,0 +1,120 @@
+#!/bin/bash
+
+# i2c-stub で BME280 を模擬して、実機無しでドライバを試験する
+# 要 root, i2c-tools。事前に i2c_bme280.ko と user_src を make しておくこと
+#
+# usage: stub_tester.sh [-t samples] [-m max_transactions]
+#   -t  samples 件をバックグラウンド測定から読み出し、1サンプルあたりのI2Cトランザクション数と所要時間を測る
+#   -m  1サンプルあたりのトランザクション数がこれを超えたら失敗にする(既定 1: 測定データの一括読み出しのみ)
+
+ADDR=0x76
+SAMPLES=0
+MAX_TRANSACTIONS=1
+INTERVAL_MS=10
+TRACING=/sys/kernel/tracing
+EXPECTED="temperature=25.08, pressure=1006.53, humidity=55.00"
+# ドライバ内で補正した固定小数点の値 (0.01 degC, Pa * 256, %RH * 1024)
+EXPECTED_DRIVER="driver: temperature=2508, pressure=25767233, humidity=56317"
+
+while getopts "t:m:" opt; do
+    case ${opt} in
+        t) SAMPLES=${OPTARG} ;;
+        m) MAX_TRANSACTIONS=${OPTARG} ;;
+        *) echo "usage: $0 [-t samples] [-m max_transactions]"; exit 1 ;;
+    esac
+done
+
+cd "$(dirname "$0")"
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+cleanup() {
+    if [ -n "${BUS}" ]; then
+        echo 0 > ${TRACING}/events/smbus/enable 2>/dev/null
+        bash ./deldevice.sh ${BUS} ${ADDR} 2>/dev/null
+    fi
+    rmmod i2c_bme280 2>/dev/null
+    rmmod i2c-stub 2>/dev/null
+}
+trap cleanup EXIT
+
+modprobe i2c-dev || fail "modprobe i2c-dev"
+modprobe i2c-stub chip_addr=${ADDR} || fail "modprobe i2c-stub"
+for dev in /sys/bus/i2c/devices/i2c-*; do
+    if grep -q "SMBus stub driver" ${dev}/name; then
+        BUS=${dev##*/i2c-}
+    fi
+done
+[ -n "${BUS}" ] || fail "i2c-stub adapter not found"
+echo "i2c-stub on i2c-${BUS}"
+
+# レジスタの初期値
+#   0xD0        chip id
+#   0x88-0x9F   dig_T1-T3, dig_P1-P9 (データシート 8.2 の例)
+#   0xA1        dig_H1
+#   0xE1-0xE7   dig_H2-H6 (H2=362 H3=0 H4=313 H5=50 H6=30)
+#   0xF7-0xFE   adc_P=415148 adc_T=519888 adc_H=30000
+REGS=(
+    0xD0 0x60
+    0x88 0x70 0x89 0x6b 0x8a 0x43 0x8b 0x67 0x8c 0x18 0x8d 0xfc
+    0x8e 0x7d 0x8f 0x8e 0x90 0x43 0x91 0xd6 0x92 0xd0 0x93 0x0b
+    0x94 0x27 0x95 0x0b 0x96 0x8c 0x97 0x00 0x98 0xf9 0x99 0xff
+    0x9a 0x8c 0x9b 0x3c 0x9c 0xf8 0x9d 0xc6 0x9e 0x70 0x9f 0x17
+    0xA1 0x4b
+    0xE1 0x6a 0xE2 0x01 0xE3 0x00 0xE4 0x13 0xE5 0x29 0xE6 0x03 0xE7 0x1e
+    0xF7 0x65 0xF8 0x5a 0xF9 0xc0 0xFA 0x7e 0xFB 0xed 0xFC 0x00 0xFD 0x75 0xFE 0x30
+)
+for ((i = 0; i < ${#REGS[@]}; i += 2)); do
+    i2cset -y ${BUS} ${ADDR} ${REGS[i]} ${REGS[i + 1]} b || fail "i2cset ${REGS[i]}"
+done
+
+insmod i2c_bme280.ko || fail "insmod i2c_bme280.ko"
+bash ./newdevice.sh ${BUS} ${ADDR}
+
+DEVICE=/dev/i2c_bme280-${BUS}-${ADDR#0x}
+for ((i = 0; i < 50; i++)); do
+    [ -c ${DEVICE} ] && break
+    sleep 0.1
+done
+[ -c ${DEVICE} ] || fail "${DEVICE} not created"
+
+# libbme280 で補正した値と、I2C_BME280_READ_ENV_COMPENSATED でドライバが補正した値
+OUTPUT=$(./user_src/user_sample ${DEVICE}) || fail "user_sample"
+RESULT=$(echo "${OUTPUT}" | grep "^temperature=")
+echo "${RESULT}"
+[ "${RESULT}" = "${EXPECTED}" ] || fail "expected ${EXPECTED}"
+RESULT=$(echo "${OUTPUT}" | grep "^driver: ")
+echo "${RESULT}"
+[ "${RESULT}" = "${EXPECTED_DRIVER}" ] || fail "expected ${EXPECTED_DRIVER}"
+
+# read() で読み出す i2c_bme280_sample の comp (先頭から 28 バイト目)
+RECORD=$(dd if=${DEVICE} bs=40 count=1 iflag=fullblock status=none | od -An -v -t d4 -j 28 -N 12)
+RESULT=$(echo ${RECORD} | awk '{ printf "driver: temperature=%d, pressure=%u, humidity=%u", $1, $2 % 4294967296, $3 % 4294967296 }')
+echo "read(): ${RESULT#driver: }"
+[ "${RESULT}" = "${EXPECTED_DRIVER}" ] || fail "read() record: expected ${EXPECTED_DRIVER}"
+
+if [ ${SAMPLES} -gt 0 ]; then
+    # バックグラウンド測定の周期を短くし、read() で samples 件読む間の SMBus 転送を数える
+    echo ${INTERVAL_MS} > /sys/module/i2c_bme280/parameters/sampling_interval_ms
+    echo > ${TRACING}/trace
+    echo 1 > ${TRACING}/events/smbus/smbus_read/enable
+    echo 1 > ${TRACING}/events/smbus/smbus_write/enable
+
+    START=$(date +%s%N)
+    dd if=${DEVICE} of=/dev/null bs=40 count=${SAMPLES} iflag=fullblock status=none || fail "read samples"
+    END=$(date +%s%N)
+
+    echo 0 > ${TRACING}/events/smbus/enable
+    TRANSACTIONS=$(grep -cE "smbus_(read|write): i2c-${BUS} " ${TRACING}/trace)
+    echo 0 > /sys/module/i2c_bme280/parameters/sampling_interval_ms
+
+    # 読み終わってから止めるまでの間の測定分を除くため、件数は切り捨てで比べる
+    PER_SAMPLE=$((TRANSACTIONS / SAMPLES))
+    echo "samples=${SAMPLES} transactions=${TRANSACTIONS} per_sample=${PER_SAMPLE} elapsed_ms=$(((END - START) / 1000000))"
+    [ ${PER_SAMPLE} -le ${MAX_TRANSACTIONS} ] || fail "${PER_SAMPLE} transactions per sample (max ${MAX_TRANSACTIONS})"
+fi
+
+echo "PASS"
@@ -0,0 +1,115 @@
+#include "bme280.h"
+#include "bme280_internal.h"
+
+typedef void (*bme280_batch_func)( const bme280_handle*, size_t,
+                                   const int32_t*, const int32_t*, const int32_t*,
+                                   double*, double*, double* );
+typedef void (*bme280_batch_fixed_func)( const bme280_handle*, size_t,
+                                         const int32_t*, const int32_t*, const int32_t*,
+                                         int32_t*, uint32_t*, uint32_t* );
+
+// CPUがAVX2に対応しているか
+static int bme280_use_avx2( void )
+{
+#ifdef BME280_HAVE_AVX2
+    __builtin_cpu_init();
+    return __builtin_cpu_supports( "avx2" );
+#else
+    return 0;
+#endif
+}
+
+// CPUに合わせて一括処理の実装を選ぶ
+static bme280_batch_func bme280_select_batch( void )
+{
+#ifdef BME280_HAVE_AVX2
+    if( bme280_use_avx2() ){
+        return bme280_compensate_batch_avx2;
+    }
+#endif
+    return bme280_compensate_batch_generic;
+}
+
+static bme280_batch_fixed_func bme280_select_batch_fixed( void )
+{
+#ifdef BME280_HAVE_AVX2
+    if( bme280_use_avx2() ){
+        return bme280_compensate_batch_fixed_avx2;
+    }
+#endif
+    return bme280_compensate_batch_fixed_generic;
+}
+
+void bme280_init( bme280_handle* handle, const i2c_bme280_ioctl_param* param )
+{
+    const bme280_comp_temperature* dig_t = &(param->dig_t);
+    const bme280_comp_pressure*    dig_p = &(param->dig_p);
+    const bme280_comp_humidity*    dig_h = &(param->dig_h);
+
+    handle->t1    = (int32_t)dig_t->t1;
+    handle->t1_x2 = (int32_t)dig_t->t1 << 1;
+    handle->t2    = (int32_t)dig_t->t2;
+    handle->t3    = (int32_t)dig_t->t3;
+
+    handle->p1       = (int64_t)dig_p->p1;
+    handle->p2_x4096 = (int64_t)dig_p->p2 * 4096;
+    handle->p3       = (int64_t)dig_p->p3;
+    handle->p4_x2_35 = (int64_t)dig_p->p4 * ((int64_t)1 << 35);
+    handle->p5_x2_17 = (int64_t)dig_p->p5 * ((int64_t)1 << 17);
+    handle->p6       = (int64_t)dig_p->p6;
+    handle->p7_x16   = (int64_t)dig_p->p7 * 16;
+    handle->p8       = (int64_t)dig_p->p8;
+    handle->p9       = (int64_t)dig_p->p9;
+
+    handle->h1       = (int32_t)dig_h->h1;
+    handle->h2       = (int32_t)dig_h->h2;
+    handle->h3       = (int32_t)dig_h->h3;
+    handle->h4_x2_20 = (int32_t)dig_h->h4 * (1 << 20);
+    handle->h5       = (int32_t)dig_h->h5;
+    handle->h6       = (int32_t)dig_h->h6;
+}
+
+void bme280_compensate_fixed( const bme280_handle* handle, const i2c_bme280_env_raw* raw, i2c_bme280_env_compensated* out )
+{
+    int32_t t_fine;
+
+    t_fine = bme280_calc_t_fine( handle, raw->temperature );
+    out->temperature = bme280_calc_temperature( t_fine );
+    out->pressure    = bme280_calc_pressure( handle, raw->pressure, t_fine );
+    out->humidity    = bme280_calc_humidity( handle, raw->humidity, t_fine );
+}
+
+void bme280_compensate( const bme280_handle* handle, const i2c_bme280_env_raw* raw, bme280_measured* out )
+{
+    i2c_bme280_env_compensated comp;
+
+    bme280_compensate_fixed( handle, raw, &comp );
+    bme280_to_measured( &comp, out );
+}
+
+void bme280_compensate_batch_fixed( const bme280_handle* handle, size_t count,
+                                    const int32_t* adc_t, const int32_t* adc_p, const int32_t* adc_h,
+                                    int32_t* temperature, uint32_t* pressure, uint32_t* humidity )
+{
+    static bme280_batch_fixed_func s_batch_fixed = NULL;
+
+    if( s_batch_fixed == NULL ){
+        s_batch_fixed = bme280_select_batch_fixed();
+    }
+
+    s_batch_fixed( handle, count, adc_t, adc_p, adc_h, temperature, pressure, humidity );
+}
+
+void bme280_compensate_batch( const bme280_handle* handle, size_t count,
+                              const int32_t* adc_t, const int32_t* adc_p, const int32_t* adc_h,
+                              double* temperature, double* pressure, double* humidity )
+{
+    static bme280_batch_func s_batch = NULL;
+
+    // 初回呼び出し時に実装を選ぶ。複数スレッドから同時に来ても同じ結果になるので問題ない
+    if( s_batch == NULL ){
+        s_batch = bme280_select_batch();
+    }
+
+    s_batch( handle, count, adc_t, adc_p, adc_h, temperature, pressure, humidity );
+}
@@ -0,0 +1,85 @@
+#ifndef BME280_H_INCLUDED
+#define BME280_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+// my driver header file
+#include "../i2c_bme280.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 校正値から事前に計算しておく補正係数
+// 校正値はデバイス毎に固定なので、デバイス毎に1度 bme280_init() しておけば使い回せる
+typedef struct bme280_handle_t
+{
+    // temperature
+    int32_t t1;
+    int32_t t1_x2;          // dig_T1 << 1
+    int32_t t2;
+    int32_t t3;
+
+    // pressure
+    int64_t p1;
+    int64_t p2_x4096;       // dig_P2 << 12
+    int64_t p3;
+    int64_t p4_x2_35;       // dig_P4 << 35
+    int64_t p5_x2_17;       // dig_P5 << 17
+    int64_t p6;
+    int64_t p7_x16;         // dig_P7 << 4
+    int64_t p8;
+    int64_t p9;
+
+    // humidity
+    int32_t h1;
+    int32_t h2;
+    int32_t h3;
+    int32_t h4_x2_20;       // dig_H4 << 20
+    int32_t h5;
+    int32_t h6;
+} bme280_handle;
+
+// 補正後の測定値(浮動小数点)
+// 固定小数点の値は i2c_bme280_env_compensated を使う
+typedef struct bme280_measured_t
+{
+    double temperature;     // degC
+    double pressure;        // hPa
+    double humidity;        // %RH
+} bme280_measured;
+
+// I2C_BME280_READ_COMPENSATION で読み出した校正値から補正係数を計算する
+void bme280_init( bme280_handle* handle, const i2c_bme280_ioctl_param* param );
+
+// 1サンプル分の生値を補正する
+// 浮動小数点を一切使わない整数版と、整数で補正してから単位変換する浮動小数点版がある
+// 両者の値は単位変換を除いて一致する。FPUの無い環境では整数版を使うこと
+void bme280_compensate_fixed( const bme280_handle* handle, const i2c_bme280_env_raw* raw, i2c_bme280_env_compensated* out );
+void bme280_compensate( const bme280_handle* handle, const i2c_bme280_env_raw* raw, bme280_measured* out );
+
+// count サンプル分の生値をまとめて補正する
+// 入出力は項目毎の配列(structure of arrays)。CPUがAVX2に対応していればAVX2版を使う
+// 出力の単位は整数版が i2c_bme280_env_compensated、浮動小数点版が bme280_measured と同じ
+void bme280_compensate_batch_fixed( const bme280_handle* handle, size_t count,
+                                    const int32_t* adc_t, const int32_t* adc_p, const int32_t* adc_h,
+                                    int32_t* temperature, uint32_t* pressure, uint32_t* humidity );
+void bme280_compensate_batch( const bme280_handle* handle, size_t count,
+                              const int32_t* adc_t, const int32_t* adc_p, const int32_t* adc_h,
+                              double* temperature, double* pressure, double* humidity );
+
+// 固定小数点の補正値を浮動小数点に変換する
+// ドライバの I2C_BME280_READ_ENV_COMPENSATED で読んだ値にも使える
+static inline void bme280_to_measured( const i2c_bme280_env_compensated* comp, bme280_measured* out )
+{
+    out->temperature = comp->temperature / 100.0;
+    out->pressure    = comp->pressure / 256.0 / 100.0;  // divide by 100 means Pa -> hPa
+    out->humidity    = comp->humidity / 1024.0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif      // BME280_H_INCLUDED
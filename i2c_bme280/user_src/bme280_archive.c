@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+
+#include "bme280_record.h"
+#include "bme280_series.h"
+
+// bme280_series 形式のファイルを扱うツール
+//
+//  bme280_archive pack [-d device] [-b block_samples] records series
+//      bme280_collector が出力したレコードから device の分を取り出して series に追記する
+//  bme280_archive info series
+//      ブロックの一覧(時刻範囲, 各列の最小/最大値)を表示する
+//  bme280_archive dump [-s start_ns] [-e end_ns] series
+//      start_ns 以上 end_ns 以下のサンプルを表示する。範囲外のブロックは展開しない
+
+static int archive_pack( int argc, char* argv[] );
+static int archive_info( int argc, char* argv[] );
+static int archive_dump( int argc, char* argv[] );
+static void usage( const char* prog );
+
+int main( int argc, char* argv[] )
+{
+    if( argc < 2 ){
+        usage( argv[0] );
+        return -1;
+    }
+
+    // サブコマンド以降を getopt に渡す
+    if( strcmp( argv[1], "pack" ) == 0 ){
+        return archive_pack( argc - 1, argv + 1 );
+    }
+    if( strcmp( argv[1], "info" ) == 0 ){
+        return archive_info( argc - 1, argv + 1 );
+    }
+    if( strcmp( argv[1], "dump" ) == 0 ){
+        return archive_dump( argc - 1, argv + 1 );
+    }
+
+    usage( argv[0] );
+    return -1;
+}
+
+static void usage( const char* prog )
+{
+    fprintf( stderr, "usage: %s pack [-d device] [-b block_samples] records series\n", prog );
+    fprintf( stderr, "       %s info series\n", prog );
+    fprintf( stderr, "       %s dump [-s start_ns] [-e end_ns] series\n", prog );
+}
+
+static int archive_pack( int argc, char* argv[] )
+{
+    bme280_series_writer writer;
+    bme280_record record;
+    unsigned long device = 0;
+    uint32_t block_samples = 0;
+    uint64_t packed = 0;
+    FILE* in;
+    int opt;
+    int result = 0;
+
+    while( (opt = getopt( argc, argv, "d:b:" )) != -1 ){
+        switch( opt ){
+        case 'd':
+            device = strtoul( optarg, NULL, 0 );
+            break;
+        case 'b':
+            block_samples = (uint32_t)strtoul( optarg, NULL, 0 );
+            break;
+        default:
+            return -1;
+        }
+    }
+    if( argc - optind != 2 ){
+        fprintf( stderr, "pack: records and series are required\n" );
+        return -1;
+    }
+
+    in = fopen( argv[optind], "rb" );
+    if( in == NULL ){
+        perror( "open records failed." );
+        return -1;
+    }
+    if( bme280_series_writer_open( &writer, argv[optind + 1], block_samples ) != 0 ){
+        perror( "open series failed." );
+        fclose( in );
+        return -1;
+    }
+
+    while( fread( &record, sizeof(record), 1, in ) == 1 ){
+        if( record.device != device ){
+            continue;
+        }
+        if( bme280_series_append( &writer, record.timestamp, &record.raw ) != 0 ){
+            perror( "write series failed." );
+            result = -1;
+            break;
+        }
+        packed++;
+    }
+
+    if( bme280_series_writer_close( &writer ) != 0 ){
+        perror( "write series failed." );
+        result = -1;
+    }
+    fclose( in );
+
+    printf( "packed %" PRIu64 " samples\n", packed );
+    return result;
+}
+
+static int archive_info( int argc, char* argv[] )
+{
+    bme280_series_reader reader;
+    const bme280_series_block_header* h;
+    uint64_t samples = 0;
+    uint32_t i;
+
+    if( argc != 2 ){
+        fprintf( stderr, "info: series is required\n" );
+        return -1;
+    }
+    if( bme280_series_reader_open( &reader, argv[1] ) != 0 ){
+        perror( "open series failed." );
+        return -1;
+    }
+
+    printf( "block count first_time last_time pressure(min,max) temperature(min,max) humidity(min,max) bytes\n" );
+    for( i = 0; i < reader.nblocks; ++i ){
+        h = &(reader.headers[i]);
+        printf( "%u %u %" PRIu64 " %" PRIu64 " %d,%d %d,%d %d,%d %u\n",
+                i, h->count, h->first_time, h->last_time,
+                h->min[0], h->max[0], h->min[1], h->max[1], h->min[2], h->max[2],
+                (unsigned)(sizeof(*h) + h->column_size[0] + h->column_size[1] + h->column_size[2] + h->column_size[3]) );
+        samples += h->count;
+    }
+    printf( "%u blocks, %" PRIu64 " samples, %zu bytes\n", reader.nblocks, samples, reader.size );
+
+    bme280_series_reader_close( &reader );
+    return 0;
+}
+
+static int archive_dump( int argc, char* argv[] )
+{
+    bme280_series_reader reader;
+    uint64_t start = 0;
+    uint64_t end = UINT64_MAX;
+    uint64_t* time = NULL;
+    int32_t* value[3] = { NULL, NULL, NULL };
+    uint32_t block;
+    int count;
+    int opt;
+    int result = -1;
+    int i;
+
+    while( (opt = getopt( argc, argv, "s:e:" )) != -1 ){
+        switch( opt ){
+        case 's':
+            start = strtoull( optarg, NULL, 0 );
+            break;
+        case 'e':
+            end = strtoull( optarg, NULL, 0 );
+            break;
+        default:
+            return -1;
+        }
+    }
+    if( argc - optind != 1 ){
+        fprintf( stderr, "dump: series is required\n" );
+        return -1;
+    }
+    if( bme280_series_reader_open( &reader, argv[optind] ) != 0 ){
+        perror( "open series failed." );
+        return -1;
+    }
+
+    time = malloc( sizeof(uint64_t) * reader.block_samples );
+    for( i = 0; i < 3; ++i ){
+        value[i] = malloc( sizeof(int32_t) * reader.block_samples );
+    }
+    if( time == NULL || value[0] == NULL || value[1] == NULL || value[2] == NULL ){
+        perror( "malloc" );
+        goto END;
+    }
+
+    printf( "timestamp pressure temperature humidity\n" );
+    for( block = bme280_series_find( &reader, start ); block < reader.nblocks; ++block ){
+        if( reader.headers[block].first_time > end ){
+            break;
+        }
+        count = bme280_series_decode( &reader, block, BME280_SERIES_ALL, time, value[0], value[1], value[2] );
+        if( count < 0 ){
+            fprintf( stderr, "block %u is corrupted\n", block );
+            goto END;
+        }
+        for( i = 0; i < count; ++i ){
+            if( time[i] < start || time[i] > end ){
+                continue;
+            }
+            printf( "%" PRIu64 " %d %d %d\n", time[i], value[0][i], value[1][i], value[2][i] );
+        }
+    }
+    result = 0;
+
+END:
+    free( time );
+    for( i = 0; i < 3; ++i ){
+        free( value[i] );
+    }
+    bme280_series_reader_close( &reader );
+    return result;
+}
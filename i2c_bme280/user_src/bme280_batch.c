@@ -0,0 +1,4 @@
+// 一括補正処理(汎用版)
+#define BME280_BATCH_FUNC       bme280_compensate_batch_generic
+#define BME280_BATCH_FIXED_FUNC bme280_compensate_batch_fixed_generic
+#include "bme280_batch_impl.h"
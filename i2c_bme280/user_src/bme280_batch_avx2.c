@@ -0,0 +1,5 @@
+// 一括補正処理(AVX2版)
+// Makefile で -mavx2 を付けてビルドする。AVX2 に対応したCPUでのみ呼ばれる
+#define BME280_BATCH_FUNC       bme280_compensate_batch_avx2
+#define BME280_BATCH_FIXED_FUNC bme280_compensate_batch_fixed_avx2
+#include "bme280_batch_impl.h"
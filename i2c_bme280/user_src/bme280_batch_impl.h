@@ -0,0 +1,61 @@
+// 一括補正処理の本体
+// BME280_BATCH_FUNC, BME280_BATCH_FIXED_FUNC に関数名を定義してから include する
+// 同じ実装をコンパイルオプション(-mavx2 など)を変えて複数回ビルドするためにヘッダにしている
+
+#include "bme280_internal.h"
+
+// 一度に処理するサンプル数(スタック上の一時領域の大きさ)
+#define BME280_BATCH_CHUNK  256
+
+void BME280_BATCH_FIXED_FUNC( const bme280_handle* handle, size_t count,
+                              const int32_t* restrict adc_t, const int32_t* restrict adc_p, const int32_t* restrict adc_h,
+                              int32_t* restrict temperature, uint32_t* restrict pressure, uint32_t* restrict humidity )
+{
+    // ループ中に handle が書き換わらないことをコンパイラに伝えるためローカルにコピーする
+    const bme280_handle h = *handle;
+    int32_t t_fine[BME280_BATCH_CHUNK];
+    size_t base;
+    size_t n;
+    size_t i;
+
+    for( base = 0; base < count; base += n ){
+        n = count - base < BME280_BATCH_CHUNK ? count - base : BME280_BATCH_CHUNK;
+
+        // 項目毎にループを分けて、それぞれのループを単純にしてベクトル化しやすくする
+        for( i = 0; i < n; ++i ){
+            t_fine[i] = bme280_calc_t_fine( &h, adc_t[base + i] );
+            temperature[base + i] = bme280_calc_temperature( t_fine[i] );
+        }
+        for( i = 0; i < n; ++i ){
+            humidity[base + i] = bme280_calc_humidity( &h, adc_h[base + i], t_fine[i] );
+        }
+        // 64bit除算を含むのでベクトル化はされないが、分岐が無いのでパイプラインは乱れない
+        for( i = 0; i < n; ++i ){
+            pressure[base + i] = bme280_calc_pressure( &h, adc_p[base + i], t_fine[i] );
+        }
+    }
+}
+
+void BME280_BATCH_FUNC( const bme280_handle* handle, size_t count,
+                        const int32_t* restrict adc_t, const int32_t* restrict adc_p, const int32_t* restrict adc_h,
+                        double* restrict temperature, double* restrict pressure, double* restrict humidity )
+{
+    int32_t  t[BME280_BATCH_CHUNK];
+    uint32_t p[BME280_BATCH_CHUNK];
+    uint32_t h[BME280_BATCH_CHUNK];
+    size_t base;
+    size_t n;
+    size_t i;
+
+    // 整数で補正してから単位を変換する
+    for( base = 0; base < count; base += n ){
+        n = count - base < BME280_BATCH_CHUNK ? count - base : BME280_BATCH_CHUNK;
+
+        BME280_BATCH_FIXED_FUNC( handle, n, adc_t + base, adc_p + base, adc_h + base, t, p, h );
+        for( i = 0; i < n; ++i ){
+            temperature[base + i] = t[i] / 100.0;
+            pressure[base + i]    = p[i] / 256.0 / 100.0;
+            humidity[base + i]    = h[i] / 1024.0;
+        }
+    }
+}
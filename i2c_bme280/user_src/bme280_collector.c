@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdint.h>
+
+// my driver header file
+#include "../i2c_bme280.h"
+#include "bme280.h"
+#include "bme280_record.h"
+
+// BME280 を一定周期で測定して bme280_record を書き出し続ける常駐プログラム
+//
+//  bme280_collector [-i interval_ms] [-o file | -u socket] device...
+//
+// デバイスはいくつでも指定でき、1つの epoll ループで扱う
+// 各デバイスは open したまま、校正値も起動時に1度だけ読んでおく
+// 測定周期は CLOCK_MONOTONIC 上の絶対時刻で timerfd に設定するので、処理時間で周期がずれていかない
+
+#define DEFAULT_INTERVAL_MS     1000
+#define MAX_EVENTS              16
+
+typedef struct collector_device_t
+{
+    const char*     path;
+    int             fd;
+    int             timer_fd;
+    bme280_handle   handle;
+} collector_device;
+
+typedef struct collector_t
+{
+    collector_device*   devices;
+    int                 ndevices;
+    int                 epoll_fd;
+    int                 signal_fd;
+    int                 out_fd;
+    uint32_t            interval_ms;
+} collector;
+
+static int collector_open_device( collector* col, int index, const char* path );
+static int collector_open_output( const char* file, const char* socket_path );
+static int collector_sample( collector* col, int index, bme280_record* record );
+static int collector_run( collector* col );
+static void collector_close( collector* col );
+static void usage( const char* prog );
+
+int main( int argc, char* argv[] )
+{
+    collector col;
+    const char* file = NULL;
+    const char* socket_path = NULL;
+    sigset_t sigs;
+    struct epoll_event ev;
+    int opt;
+    int result;
+    int i;
+
+    memset( &col, 0, sizeof(col) );
+    col.epoll_fd = -1;
+    col.signal_fd = -1;
+    col.out_fd = -1;
+    col.interval_ms = DEFAULT_INTERVAL_MS;
+
+    while( (opt = getopt( argc, argv, "i:o:u:h" )) != -1 ){
+        switch( opt ){
+        case 'i':
+            col.interval_ms = (uint32_t)strtoul( optarg, NULL, 0 );
+            break;
+        case 'o':
+            file = optarg;
+            break;
+        case 'u':
+            socket_path = optarg;
+            break;
+        default:
+            usage( argv[0] );
+            return -1;
+        }
+    }
+    if( optind >= argc || col.interval_ms == 0 || (file != NULL && socket_path != NULL) ){
+        usage( argv[0] );
+        return -1;
+    }
+
+    // SIGINT, SIGTERM も epoll で受けて、ループを抜けてから後始末する
+    sigemptyset( &sigs );
+    sigaddset( &sigs, SIGINT );
+    sigaddset( &sigs, SIGTERM );
+    if( sigprocmask( SIG_BLOCK, &sigs, NULL ) != 0 ){
+        perror( "sigprocmask" );
+        return -1;
+    }
+
+    result = -1;
+    col.epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+    if( col.epoll_fd < 0 ){
+        perror( "epoll_create1" );
+        goto END;
+    }
+    col.signal_fd = signalfd( -1, &sigs, SFD_CLOEXEC );
+    if( col.signal_fd < 0 ){
+        perror( "signalfd" );
+        goto END;
+    }
+    ev.events = EPOLLIN;
+    ev.data.u32 = UINT32_MAX;
+    if( epoll_ctl( col.epoll_fd, EPOLL_CTL_ADD, col.signal_fd, &ev ) != 0 ){
+        perror( "epoll_ctl" );
+        goto END;
+    }
+
+    col.out_fd = collector_open_output( file, socket_path );
+    if( col.out_fd < 0 ){
+        goto END;
+    }
+
+    col.ndevices = argc - optind;
+    col.devices = calloc( col.ndevices, sizeof(collector_device) );
+    if( col.devices == NULL ){
+        perror( "calloc" );
+        goto END;
+    }
+    for( i = 0; i < col.ndevices; ++i ){
+        col.devices[i].fd = -1;
+        col.devices[i].timer_fd = -1;
+    }
+    for( i = 0; i < col.ndevices; ++i ){
+        if( collector_open_device( &col, i, argv[optind + i] ) != 0 ){
+            goto END;
+        }
+    }
+
+    result = collector_run( &col );
+
+END:
+    collector_close( &col );
+    return result;
+}
+
+static void usage( const char* prog )
+{
+    fprintf( stderr, "usage: %s [-i interval_ms] [-o file | -u socket] device...\n", prog );
+    fprintf( stderr, "  -i  sampling interval in ms (default %d)\n", DEFAULT_INTERVAL_MS );
+    fprintf( stderr, "  -o  append records to file\n" );
+    fprintf( stderr, "  -u  send records to unix datagram socket\n" );
+    fprintf( stderr, "  records are written to stdout if neither -o nor -u is given\n" );
+}
+
+static int collector_open_output( const char* file, const char* socket_path )
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if( file != NULL ){
+        fd = open( file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644 );
+        if( fd < 0 ){
+            perror( "open output file failed." );
+        }
+        return fd;
+    }
+
+    if( socket_path != NULL ){
+        if( strlen( socket_path ) >= sizeof(addr.sun_path) ){
+            fprintf( stderr, "socket path too long: %s\n", socket_path );
+            return -1;
+        }
+        fd = socket( AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0 );
+        if( fd < 0 ){
+            perror( "socket" );
+            return -1;
+        }
+        memset( &addr, 0, sizeof(addr) );
+        addr.sun_family = AF_UNIX;
+        strcpy( addr.sun_path, socket_path );
+        if( connect( fd, (struct sockaddr*)&addr, sizeof(addr) ) != 0 ){
+            perror( "connect" );
+            close( fd );
+            return -1;
+        }
+        return fd;
+    }
+
+    return dup( STDOUT_FILENO );
+}
+
+static int collector_open_device( collector* col, int index, const char* path )
+{
+    collector_device* dev = &(col->devices[index]);
+    i2c_bme280_ioctl_param param;
+    struct itimerspec its;
+    struct epoll_event ev;
+
+    dev->path = path;
+    dev->fd = open( path, O_RDONLY | O_CLOEXEC );
+    if( dev->fd < 0 ){
+        fprintf( stderr, "open %s failed: %s\n", path, strerror( errno ) );
+        return -1;
+    }
+
+    // 校正値はデバイス毎に固定なので起動時に1度だけ読む
+    if( ioctl( dev->fd, I2C_BME280_READ_COMPENSATION, &param ) < 0 ){
+        fprintf( stderr, "ioctl read compensation failed. %s: %s\n", path, strerror( errno ) );
+        return -1;
+    }
+    bme280_init( &(dev->handle), &param );
+
+    dev->timer_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+    if( dev->timer_fd < 0 ){
+        perror( "timerfd_create" );
+        return -1;
+    }
+
+    // 最初の期限を絶対時刻で指定し、以降は it_interval 毎に期限が進む
+    // 期限は前回の期限から数えるので、読み出しが遅れても周期はずれない
+    clock_gettime( CLOCK_MONOTONIC, &its.it_value );
+    its.it_interval.tv_sec = col->interval_ms / 1000;
+    its.it_interval.tv_nsec = (long)(col->interval_ms % 1000) * 1000000;
+    if( timerfd_settime( dev->timer_fd, TFD_TIMER_ABSTIME, &its, NULL ) != 0 ){
+        perror( "timerfd_settime" );
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.u32 = (uint32_t)index;
+    if( epoll_ctl( col->epoll_fd, EPOLL_CTL_ADD, dev->timer_fd, &ev ) != 0 ){
+        perror( "epoll_ctl" );
+        return -1;
+    }
+
+    return 0;
+}
+
+static int collector_sample( collector* col, int index, bme280_record* record )
+{
+    collector_device* dev = &(col->devices[index]);
+    i2c_bme280_ioctl_param param;
+    struct timespec now;
+    uint64_t expirations;
+
+    // 期限切れ回数。2以上なら間の周期を取りこぼしている
+    if( read( dev->timer_fd, &expirations, sizeof(expirations) ) != sizeof(expirations) ){
+        return errno == EAGAIN ? 0 : -1;
+    }
+
+    if( ioctl( dev->fd, I2C_BME280_READ_ENV_MEASURED, &param ) < 0 ){
+        fprintf( stderr, "ioctl read measured values failed. %s: %s\n", dev->path, strerror( errno ) );
+        return 0;
+    }
+    clock_gettime( CLOCK_REALTIME, &now );
+
+    memset( record, 0, sizeof(*record) );
+    record->timestamp = (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+    record->device = (uint16_t)index;
+    record->overrun = (uint32_t)(expirations - 1);
+    record->raw.pressure = param.pressure;
+    record->raw.temperature = param.temperature;
+    record->raw.humidity = param.humidity;
+    bme280_compensate_fixed( &(dev->handle), &(record->raw), &(record->comp) );
+
+    return 1;
+}
+
+static int collector_run( collector* col )
+{
+    struct epoll_event events[MAX_EVENTS];
+    bme280_record records[MAX_EVENTS];
+    int nrecords;
+    ssize_t written;
+    int nevents;
+    int result;
+    int i;
+
+    for( ;; ){
+        nevents = epoll_wait( col->epoll_fd, events, MAX_EVENTS, -1 );
+        if( nevents < 0 ){
+            if( errno == EINTR ){
+                continue;
+            }
+            perror( "epoll_wait" );
+            return -1;
+        }
+
+        // 同時に期限が来たデバイスの分はまとめて1回で書き出す
+        nrecords = 0;
+        for( i = 0; i < nevents; ++i ){
+            if( events[i].data.u32 == UINT32_MAX ){
+                // SIGINT, SIGTERM
+                return 0;
+            }
+            result = collector_sample( col, (int)events[i].data.u32, &records[nrecords] );
+            if( result < 0 ){
+                perror( "read timerfd" );
+                return -1;
+            }
+            nrecords += result;
+        }
+        if( nrecords == 0 ){
+            continue;
+        }
+
+        written = write( col->out_fd, records, sizeof(bme280_record) * nrecords );
+        if( written < 0 ){
+            // 受信側がいない間のソケットへの送信は捨てて続ける
+            if( errno == ECONNREFUSED || errno == ENOENT || errno == EAGAIN ){
+                continue;
+            }
+            perror( "write" );
+            return -1;
+        }
+    }
+}
+
+static void collector_close( collector* col )
+{
+    int i;
+
+    for( i = 0; i < col->ndevices && col->devices != NULL; ++i ){
+        if( col->devices[i].timer_fd >= 0 ){
+            close( col->devices[i].timer_fd );
+        }
+        if( col->devices[i].fd >= 0 ){
+            close( col->devices[i].fd );
+        }
+    }
+    free( col->devices );
+
+    if( col->out_fd >= 0 ){
+        close( col->out_fd );
+    }
+    if( col->signal_fd >= 0 ){
+        close( col->signal_fd );
+    }
+    if( col->epoll_fd >= 0 ){
+        close( col->epoll_fd );
+    }
+}
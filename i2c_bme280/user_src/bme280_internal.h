@@ -0,0 +1,84 @@
+#ifndef BME280_INTERNAL_H_INCLUDED
+#define BME280_INTERNAL_H_INCLUDED
+
+// libbme280 内部でのみ使用する補正計算
+// 計算式はデータシート記載の整数版補正式そのもので、事前計算した係数を使う以外は同じ結果になる
+// 一括処理で自動ベクトル化されるよう、分岐を使わずに書いている
+
+#include "bme280.h"
+
+// 気温の補正。戻り値は t_fine
+static inline int32_t bme280_calc_t_fine( const bme280_handle* handle, int32_t adc_T )
+{
+    int32_t var1, var2, diff;
+
+    var1 = (((adc_T >> 3) - handle->t1_x2) * handle->t2) >> 11;
+    diff = (adc_T >> 4) - handle->t1;
+    var2 = (((diff * diff) >> 12) * handle->t3) >> 14;
+
+    return var1 + var2;
+}
+
+// t_fine -> 0.01 degC
+static inline int32_t bme280_calc_temperature( int32_t t_fine )
+{
+    return (t_fine * 5 + 128) >> 8;
+}
+
+// 気圧の補正 [Pa * 256]
+static inline uint32_t bme280_calc_pressure( const bme280_handle* handle, int32_t adc_P, int32_t t_fine )
+{
+    int64_t var1, var2, p;
+    int64_t zero;
+
+    var1 = (int64_t)t_fine - 128000;
+    var2 = var1 * var1 * handle->p6;
+    var2 = var2 + var1 * handle->p5_x2_17;
+    var2 = var2 + handle->p4_x2_35;
+    var1 = ((var1 * var1 * handle->p3) >> 8) + var1 * handle->p2_x4096;
+    var1 = ((((int64_t)1) << 47) + var1) * handle->p1 >> 33;
+
+    // var1 == 0 の場合はゼロ除算を避けて 0 を返す
+    zero = (var1 == 0);
+    p = 1048576 - adc_P;
+    p = (((p << 31) - var2) * 3125) / (var1 | zero);
+    var1 = (handle->p9 * (p >> 13) * (p >> 13)) >> 25;
+    var2 = (handle->p8 * p) >> 19;
+    p = ((p + var1 + var2) >> 8) + handle->p7_x16;
+
+    return (uint32_t)(p & (zero - 1));
+}
+
+// 湿度の補正 [%RH * 1024]
+static inline uint32_t bme280_calc_humidity( const bme280_handle* handle, int32_t adc_H, int32_t t_fine )
+{
+    int32_t v_x1;
+
+    v_x1 = t_fine - ((int32_t)76800);
+    v_x1 = (((((adc_H << 14) - handle->h4_x2_20 - (handle->h5 * v_x1)) + ((int32_t)16384)) >> 15) *
+            (((((((v_x1 * handle->h6) >> 10) * (((v_x1 * handle->h3) >> 11) + ((int32_t)32768))) >> 10) +
+            ((int32_t)2097152)) * handle->h2 + 8192) >> 14));
+    v_x1 = v_x1 - (((((v_x1 >> 15) * (v_x1 >> 15)) >> 7) * handle->h1) >> 4);
+    v_x1 = v_x1 < 0 ? 0 : v_x1;
+    v_x1 = v_x1 > 419430400 ? 419430400 : v_x1;
+
+    return (uint32_t)(v_x1 >> 12);
+}
+
+// 一括処理の実装
+void bme280_compensate_batch_generic( const bme280_handle* handle, size_t count,
+                                      const int32_t* adc_t, const int32_t* adc_p, const int32_t* adc_h,
+                                      double* temperature, double* pressure, double* humidity );
+void bme280_compensate_batch_fixed_generic( const bme280_handle* handle, size_t count,
+                                            const int32_t* adc_t, const int32_t* adc_p, const int32_t* adc_h,
+                                            int32_t* temperature, uint32_t* pressure, uint32_t* humidity );
+#ifdef BME280_HAVE_AVX2
+void bme280_compensate_batch_avx2( const bme280_handle* handle, size_t count,
+                                   const int32_t* adc_t, const int32_t* adc_p, const int32_t* adc_h,
+                                   double* temperature, double* pressure, double* humidity );
+void bme280_compensate_batch_fixed_avx2( const bme280_handle* handle, size_t count,
+                                         const int32_t* adc_t, const int32_t* adc_p, const int32_t* adc_h,
+                                         int32_t* temperature, uint32_t* pressure, uint32_t* humidity );
+#endif
+
+#endif      // BME280_INTERNAL_H_INCLUDED
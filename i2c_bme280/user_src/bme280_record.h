@@ -0,0 +1,22 @@
+#ifndef BME280_RECORD_H_INCLUDED
+#define BME280_RECORD_H_INCLUDED
+
+#include <stdint.h>
+
+// my driver header file
+#include "../i2c_bme280.h"
+
+// bme280_collector が出力する1サンプル分のレコード
+// ファイルにはこのレコードを先頭から順に書き足していく(ヘッダ無し、ホストのバイトオーダ)
+// Unixドメインソケット(SOCK_DGRAM)の場合は、1データグラムに1件以上のレコードを詰めて送る
+typedef struct bme280_record_t
+{
+    uint64_t timestamp;     // 測定した時刻 CLOCK_REALTIME [ns]
+    uint16_t device;        // コマンドラインで指定したデバイスの順番(0から)
+    uint16_t reserved;      // 0
+    uint32_t overrun;       // 前回のレコードから取りこぼした周期の数
+    i2c_bme280_env_raw          raw;    // 未補正の生値
+    i2c_bme280_env_compensated  comp;   // 補正値
+} bme280_record;
+
+#endif      // BME280_RECORD_H_INCLUDED
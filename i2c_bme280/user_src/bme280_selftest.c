@@ -0,0 +1,479 @@
+// libbme280 の補正計算の検証
+// 生値の全範囲と複数の校正値について、整数版・浮動小数点版・一括処理の全実装の結果を
+// データシート記載の補正式(Bosch のリファレンス実装)と比較する
+// 不一致があれば終了コード 1 で終わる。make check で実行する
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "bme280.h"
+#include "bme280_internal.h"
+
+// 一度に検証するサンプル数
+#define CHECK_CHUNK         65536
+// 不一致を表示する最大件数(検証毎)
+#define MAX_REPORT          8
+
+// 浮動小数点版の補正式との許容誤差
+// 整数版の補正式は浮動小数点版とは計算方法が違うので、分解能程度の差が出る
+#define TOLERANCE_DEGC      0.01
+#define TOLERANCE_HPA       0.02
+#define TOLERANCE_RH        0.05
+
+//
+// データシート 4.2.3 / 8.1 の補正式そのもの
+// 変数名、型名もデータシートのまま
+//
+typedef int32_t  BME280_S32_t;
+typedef uint32_t BME280_U32_t;
+typedef int64_t  BME280_S64_t;
+
+static unsigned short dig_T1;
+static short dig_T2, dig_T3;
+static unsigned short dig_P1;
+static short dig_P2, dig_P3, dig_P4, dig_P5, dig_P6, dig_P7, dig_P8, dig_P9;
+static unsigned char dig_H1, dig_H3;
+static short dig_H2, dig_H4, dig_H5;
+static signed char dig_H6;
+
+// Returns temperature in DegC, resolution is 0.01 DegC. Output value of “5123” equals 51.23 DegC.
+// t_fine carries fine temperature as global value
+static BME280_S32_t t_fine;
+static BME280_S32_t BME280_compensate_T_int32(BME280_S32_t adc_T)
+{
+    BME280_S32_t var1, var2, T;
+    var1 = ((((adc_T>>3) - ((BME280_S32_t)dig_T1<<1))) * ((BME280_S32_t)dig_T2)) >> 11;
+    var2 = (((((adc_T>>4) - ((BME280_S32_t)dig_T1)) * ((adc_T>>4) - ((BME280_S32_t)dig_T1))) >> 12) *
+            ((BME280_S32_t)dig_T3)) >> 14;
+    t_fine = var1 + var2;
+    T = (t_fine * 5 + 128) >> 8;
+    return T;
+}
+
+// Returns pressure in Pa as unsigned 32 bit integer in Q24.8 format (24 integer bits and 8 fractional bits).
+// Output value of “24674867” represents 24674867/256 = 96386.2 Pa = 963.862 hPa
+static BME280_U32_t BME280_compensate_P_int64(BME280_S32_t adc_P)
+{
+    BME280_S64_t var1, var2, p;
+    var1 = ((BME280_S64_t)t_fine) - 128000;
+    var2 = var1 * var1 * (BME280_S64_t)dig_P6;
+    var2 = var2 + ((var1*(BME280_S64_t)dig_P5)<<17);
+    var2 = var2 + (((BME280_S64_t)dig_P4)<<35);
+    var1 = ((var1 * var1 * (BME280_S64_t)dig_P3)>>8) + ((var1 * (BME280_S64_t)dig_P2)<<12);
+    var1 = (((((BME280_S64_t)1)<<47)+var1))*((BME280_S64_t)dig_P1)>>33;
+    if (var1 == 0)
+    {
+        return 0; // avoid exception caused by division by zero
+    }
+    p = 1048576-adc_P;
+    p = (((p<<31)-var2)*3125)/var1;
+    var1 = (((BME280_S64_t)dig_P9) * (p>>13) * (p>>13)) >> 25;
+    var2 = (((BME280_S64_t)dig_P8) * p) >> 19;
+    p = ((p + var1 + var2) >> 8) + (((BME280_S64_t)dig_P7)<<4);
+    return (BME280_U32_t)p;
+}
+
+// Returns humidity in %RH as unsigned 32 bit integer in Q22.10 format (22 integer and 10 fractional bits).
+// Output value of “47445” represents 47445/1024 = 46.333 %RH
+static BME280_U32_t bme280_compensate_H_int32(BME280_S32_t adc_H)
+{
+    BME280_S32_t v_x1_u32r;
+    v_x1_u32r = (t_fine - ((BME280_S32_t)76800));
+    v_x1_u32r = (((((adc_H << 14) - (((BME280_S32_t)dig_H4) << 20) - (((BME280_S32_t)dig_H5) * v_x1_u32r)) +
+            ((BME280_S32_t)16384)) >> 15) * (((((((v_x1_u32r * ((BME280_S32_t)dig_H6)) >> 10) * (((v_x1_u32r *
+            ((BME280_S32_t)dig_H3)) >> 11) + ((BME280_S32_t)32768))) >> 10) + ((BME280_S32_t)2097152)) *
+            ((BME280_S32_t)dig_H2) + 8192) >> 14));
+    v_x1_u32r = (v_x1_u32r - (((((v_x1_u32r >> 15) * (v_x1_u32r >> 15)) >> 7) * ((BME280_S32_t)dig_H1)) >> 4));
+    v_x1_u32r = (v_x1_u32r < 0 ? 0 : v_x1_u32r);
+    v_x1_u32r = (v_x1_u32r > 419430400 ? 419430400 : v_x1_u32r);
+    return (BME280_U32_t)(v_x1_u32r>>12);
+}
+
+// Returns temperature in DegC, double precision. Output value of “51.23” equals 51.23 DegC.
+// t_fine carries fine temperature as global value
+static double BME280_compensate_T_double(BME280_S32_t adc_T)
+{
+    double var1, var2, T;
+    var1 = (((double)adc_T)/16384.0 - ((double)dig_T1)/1024.0) * ((double)dig_T2);
+    var2 = ((((double)adc_T)/131072.0 - ((double)dig_T1)/8192.0) *
+            (((double)adc_T)/131072.0 - ((double) dig_T1)/8192.0)) * ((double)dig_T3);
+    t_fine = (BME280_S32_t)(var1 + var2);
+    T = (var1 + var2) / 5120.0;
+    return T;
+}
+
+// Returns pressure in Pa as double. Output value of “96386.2” equals 96386.2 Pa = 963.862 hPa
+static double BME280_compensate_P_double(BME280_S32_t adc_P)
+{
+    double var1, var2, p;
+    var1 = ((double)t_fine/2.0) - 64000.0;
+    var2 = var1 * var1 * ((double)dig_P6) / 32768.0;
+    var2 = var2 + var1 * ((double)dig_P5) * 2.0;
+    var2 = (var2/4.0)+(((double)dig_P4) * 65536.0);
+    var1 = (((double)dig_P3) * var1 * var1 / 524288.0 + ((double)dig_P2) * var1) / 524288.0;
+    var1 = (1.0 + var1 / 32768.0)*((double)dig_P1);
+    if (var1 == 0.0)
+    {
+        return 0; // avoid exception caused by division by zero
+    }
+    p = 1048576.0 - (double)adc_P;
+    p = (p - (var2 / 4096.0)) * 6250.0 / var1;
+    var1 = ((double)dig_P9) * p * p / 2147483648.0;
+    var2 = p * ((double)dig_P8) / 32768.0;
+    p = p + (var1 + var2 + ((double)dig_P7)) / 16.0;
+    return p;
+}
+
+// Returns humidity in %rH as as double. Output value of “46.332” represents 46.332 %rH
+static double bme280_compensate_H_double(BME280_S32_t adc_H)
+{
+    double var_H;
+    var_H = (((double)t_fine) - 76800.0);
+    var_H = (adc_H - (((double)dig_H4) * 64.0 + ((double)dig_H5) / 16384.0 * var_H)) *
+            (((double)dig_H2) / 65536.0 * (1.0 + ((double)dig_H6) / 67108864.0 * var_H *
+            (1.0 + ((double)dig_H3) / 67108864.0 * var_H)));
+    var_H = var_H * (1.0 - ((double)dig_H1) * var_H / 524288.0);
+    if (var_H > 100.0)
+        var_H = 100.0;
+    else if (var_H < 0.0)
+        var_H = 0.0;
+    return var_H;
+}
+
+static void ref_set_calibration( const i2c_bme280_ioctl_param* param )
+{
+    dig_T1 = param->dig_t.t1;
+    dig_T2 = param->dig_t.t2;
+    dig_T3 = param->dig_t.t3;
+    dig_P1 = param->dig_p.p1;
+    dig_P2 = param->dig_p.p2;
+    dig_P3 = param->dig_p.p3;
+    dig_P4 = param->dig_p.p4;
+    dig_P5 = param->dig_p.p5;
+    dig_P6 = param->dig_p.p6;
+    dig_P7 = param->dig_p.p7;
+    dig_P8 = param->dig_p.p8;
+    dig_P9 = param->dig_p.p9;
+    dig_H1 = param->dig_h.h1;
+    dig_H2 = param->dig_h.h2;
+    dig_H3 = param->dig_h.h3;
+    dig_H4 = param->dig_h.h4;
+    dig_H5 = param->dig_h.h5;
+    dig_H6 = param->dig_h.h6;
+}
+
+//
+// 校正値
+//
+typedef struct calibration_vector_t
+{
+    const char* name;
+    bme280_comp_temperature dig_t;
+    bme280_comp_pressure    dig_p;
+    bme280_comp_humidity    dig_h;
+} calibration_vector;
+
+static const calibration_vector sk_vectors[] = {
+    // データシート 8.2 の例。湿度は stub_tester.sh と同じ
+    { "datasheet",
+      { 27504, 26435, -1000 },
+      { 36477, -10685, 3024, 2855, 140, -7, 15500, -14600, 6000 },
+      { 75, 362, 0, 313, 50, 30 } },
+    // 実機で読み出した値
+    { "device-a",
+      { 28485, 26735, 50 },
+      { 37746, -10720, 3024, 7112, -89, -7, 9900, -10230, 4285 },
+      { 75, 359, 0, 333, 0, 30 } },
+    { "device-b",
+      { 27912, 26587, 50 },
+      { 38065, -10563, 3024, 6720, -76, -7, 9900, -10230, 4285 },
+      { 75, 363, 0, 303, 50, 30 } },
+    // 各係数を符号を含めて偏らせた値
+    // adc_T の全範囲で補正式が int32 で溢れない範囲にしておく
+    { "skewed",
+      { 26000, 27000, -500 },
+      { 34000, -11500, 4000, 9000, 200, -20, 16000, -16000, 8000 },
+      { 100, 300, 10, 400, -50, 40 } },
+};
+
+//
+// 検証
+//
+typedef struct check_result_t
+{
+    const char* name;
+    unsigned long long checked;
+    unsigned long long mismatches;
+} check_result;
+
+enum {
+    CHECK_FIXED,            // bme280_compensate_fixed
+    CHECK_DOUBLE,           // bme280_compensate
+    CHECK_BATCH_FIXED,      // bme280_compensate_batch_fixed
+    CHECK_BATCH_FIXED_GENERIC,
+#ifdef BME280_HAVE_AVX2
+    CHECK_BATCH_FIXED_AVX2,
+#endif
+    CHECK_BATCH,            // bme280_compensate_batch
+    CHECK_BATCH_GENERIC,
+#ifdef BME280_HAVE_AVX2
+    CHECK_BATCH_AVX2,
+#endif
+    CHECK_REFERENCE_DOUBLE, // 浮動小数点版の補正式との差
+    CHECK_NUM
+};
+
+static check_result s_results[CHECK_NUM] = {
+    [CHECK_FIXED]               = { "compensate_fixed" },
+    [CHECK_DOUBLE]              = { "compensate" },
+    [CHECK_BATCH_FIXED]         = { "compensate_batch_fixed" },
+    [CHECK_BATCH_FIXED_GENERIC] = { "compensate_batch_fixed (generic)" },
+#ifdef BME280_HAVE_AVX2
+    [CHECK_BATCH_FIXED_AVX2]    = { "compensate_batch_fixed (avx2)" },
+#endif
+    [CHECK_BATCH]               = { "compensate_batch" },
+    [CHECK_BATCH_GENERIC]       = { "compensate_batch (generic)" },
+#ifdef BME280_HAVE_AVX2
+    [CHECK_BATCH_AVX2]          = { "compensate_batch (avx2)" },
+#endif
+    [CHECK_REFERENCE_DOUBLE]    = { "double reference formulas" },
+};
+
+// 1サンプル分の結果を記録する。不一致を表示すべきなら 1 を返す
+static int record( int check, int match )
+{
+    check_result* result = &s_results[check];
+
+    result->checked++;
+    if( match ){
+        return 0;
+    }
+    return result->mismatches++ < MAX_REPORT;
+}
+
+static void report( int check, const calibration_vector* vector, int32_t adc_t, int32_t adc_p, int32_t adc_h )
+{
+    fprintf( stderr, "MISMATCH %s [%s] adc_T=%d adc_P=%d adc_H=%d: ",
+             s_results[check].name, vector->name, adc_t, adc_p, adc_h );
+}
+
+static void check_fixed( int check, const calibration_vector* vector, size_t n,
+                         const int32_t* adc_t, const int32_t* adc_p, const int32_t* adc_h,
+                         const i2c_bme280_env_compensated* expected,
+                         const int32_t* t, const uint32_t* p, const uint32_t* h )
+{
+    size_t i;
+
+    for( i = 0; i < n; ++i ){
+        if( record( check, t[i] == expected[i].temperature && p[i] == expected[i].pressure && h[i] == expected[i].humidity ) ){
+            report( check, vector, adc_t[i], adc_p[i], adc_h[i] );
+            fprintf( stderr, "got %d/%u/%u, expected %d/%u/%u\n",
+                     t[i], p[i], h[i], expected[i].temperature, expected[i].pressure, expected[i].humidity );
+        }
+    }
+}
+
+// 浮動小数点版の API は整数版の結果を単位変換したものなので、ビット単位で一致すること
+static void check_double( int check, const calibration_vector* vector, size_t n,
+                          const int32_t* adc_t, const int32_t* adc_p, const int32_t* adc_h,
+                          const i2c_bme280_env_compensated* expected,
+                          const double* t, const double* p, const double* h )
+{
+    bme280_measured value;
+    size_t i;
+
+    for( i = 0; i < n; ++i ){
+        bme280_to_measured( &expected[i], &value );
+        if( record( check, memcmp( &t[i], &value.temperature, sizeof(double) ) == 0 &&
+                           memcmp( &p[i], &value.pressure, sizeof(double) ) == 0 &&
+                           memcmp( &h[i], &value.humidity, sizeof(double) ) == 0 ) ){
+            report( check, vector, adc_t[i], adc_p[i], adc_h[i] );
+            fprintf( stderr, "got %.17g/%.17g/%.17g, expected %.17g/%.17g/%.17g\n",
+                     t[i], p[i], h[i], value.temperature, value.pressure, value.humidity );
+        }
+    }
+}
+
+// n サンプル分を全実装で補正してリファレンスと比較する
+static void check_samples( const bme280_handle* handle, const calibration_vector* vector, size_t n,
+                           const int32_t* adc_t, const int32_t* adc_p, const int32_t* adc_h )
+{
+    static i2c_bme280_env_compensated expected[CHECK_CHUNK];
+    static int32_t  t[CHECK_CHUNK];
+    static uint32_t p[CHECK_CHUNK];
+    static uint32_t h[CHECK_CHUNK];
+    static double   td[CHECK_CHUNK];
+    static double   pd[CHECK_CHUNK];
+    static double   hd[CHECK_CHUNK];
+    size_t i;
+
+    for( i = 0; i < n; ++i ){
+        i2c_bme280_env_raw raw = { adc_p[i], adc_t[i], adc_h[i] };
+        i2c_bme280_env_compensated comp;
+        bme280_measured value;
+        double ref_t, ref_p, ref_h;
+
+        expected[i].temperature = BME280_compensate_T_int32( adc_t[i] );
+        expected[i].pressure    = BME280_compensate_P_int64( adc_p[i] );
+        expected[i].humidity    = bme280_compensate_H_int32( adc_h[i] );
+
+        bme280_compensate_fixed( handle, &raw, &comp );
+        t[i] = comp.temperature;
+        p[i] = comp.pressure;
+        h[i] = comp.humidity;
+
+        bme280_compensate( handle, &raw, &value );
+        td[i] = value.temperature;
+        pd[i] = value.pressure;
+        hd[i] = value.humidity;
+
+        // 浮動小数点版の補正式とは、センサーの動作範囲(-40 - 85 degC, 300 - 1100 hPa)でのみ比較する
+        if( expected[i].temperature < -4000 || expected[i].temperature > 8500 ||
+            expected[i].pressure < 30000u * 256 || expected[i].pressure > 110000u * 256 ){
+            continue;
+        }
+        ref_t = BME280_compensate_T_double( adc_t[i] );
+        ref_p = BME280_compensate_P_double( adc_p[i] ) / 100.0;
+        ref_h = bme280_compensate_H_double( adc_h[i] );
+        if( record( CHECK_REFERENCE_DOUBLE, fabs( value.temperature - ref_t ) <= TOLERANCE_DEGC &&
+                                            fabs( value.pressure - ref_p ) <= TOLERANCE_HPA &&
+                                            fabs( value.humidity - ref_h ) <= TOLERANCE_RH ) ){
+            report( CHECK_REFERENCE_DOUBLE, vector, adc_t[i], adc_p[i], adc_h[i] );
+            fprintf( stderr, "got %.4f degC/%.4f hPa/%.4f %%RH, reference %.4f/%.4f/%.4f\n",
+                     value.temperature, value.pressure, value.humidity, ref_t, ref_p, ref_h );
+        }
+    }
+    check_fixed( CHECK_FIXED, vector, n, adc_t, adc_p, adc_h, expected, t, p, h );
+    check_double( CHECK_DOUBLE, vector, n, adc_t, adc_p, adc_h, expected, td, pd, hd );
+
+    bme280_compensate_batch_fixed( handle, n, adc_t, adc_p, adc_h, t, p, h );
+    check_fixed( CHECK_BATCH_FIXED, vector, n, adc_t, adc_p, adc_h, expected, t, p, h );
+    bme280_compensate_batch_fixed_generic( handle, n, adc_t, adc_p, adc_h, t, p, h );
+    check_fixed( CHECK_BATCH_FIXED_GENERIC, vector, n, adc_t, adc_p, adc_h, expected, t, p, h );
+
+    bme280_compensate_batch( handle, n, adc_t, adc_p, adc_h, td, pd, hd );
+    check_double( CHECK_BATCH, vector, n, adc_t, adc_p, adc_h, expected, td, pd, hd );
+    bme280_compensate_batch_generic( handle, n, adc_t, adc_p, adc_h, td, pd, hd );
+    check_double( CHECK_BATCH_GENERIC, vector, n, adc_t, adc_p, adc_h, expected, td, pd, hd );
+
+#ifdef BME280_HAVE_AVX2
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "avx2" ) ){
+        bme280_compensate_batch_fixed_avx2( handle, n, adc_t, adc_p, adc_h, t, p, h );
+        check_fixed( CHECK_BATCH_FIXED_AVX2, vector, n, adc_t, adc_p, adc_h, expected, t, p, h );
+        bme280_compensate_batch_avx2( handle, n, adc_t, adc_p, adc_h, td, pd, hd );
+        check_double( CHECK_BATCH_AVX2, vector, n, adc_t, adc_p, adc_h, expected, td, pd, hd );
+    }
+#endif
+}
+
+// 気温 degc_x100 [0.01 degC] 以上になる最小の adc_T
+static int32_t find_adc_t( int32_t degc_x100 )
+{
+    int32_t adc_t;
+
+    for( adc_t = 0; adc_t <= 0xFFFFF; adc_t += 16 ){
+        if( BME280_compensate_T_int32( adc_t ) >= degc_x100 ){
+            return adc_t;
+        }
+    }
+    return 0xFFFFF;
+}
+
+static void check_vector( const calibration_vector* vector )
+{
+    static int32_t adc_t[CHECK_CHUNK];
+    static int32_t adc_p[CHECK_CHUNK];
+    static int32_t adc_h[CHECK_CHUNK];
+    i2c_bme280_ioctl_param param;
+    bme280_handle handle;
+    int32_t degc;
+    int32_t base;
+    int32_t t;
+    int i;
+
+    memset( &param, 0, sizeof(param) );
+    param.dig_t = vector->dig_t;
+    param.dig_p = vector->dig_p;
+    param.dig_h = vector->dig_h;
+    bme280_init( &handle, &param );
+    ref_set_calibration( &param );
+
+    // 20bit の adc_T の全範囲。気圧、湿度も同時に全範囲を動かす
+    for( base = 0; base <= 0xFFFFF; base += CHECK_CHUNK ){
+        for( i = 0; i < CHECK_CHUNK; ++i ){
+            adc_t[i] = base + i;
+            adc_p[i] = 0xFFFFF - (base + i);
+            adc_h[i] = (base + i) & 0xFFFF;
+        }
+        check_samples( &handle, vector, CHECK_CHUNK, adc_t, adc_p, adc_h );
+    }
+
+    // 動作範囲内のいくつかの気温で、20bit の adc_P と 16bit の adc_H の全範囲
+    for( degc = -40; degc <= 85; degc += 25 ){
+        t = find_adc_t( degc * 100 );
+        for( base = 0; base <= 0xFFFFF; base += CHECK_CHUNK ){
+            for( i = 0; i < CHECK_CHUNK; ++i ){
+                adc_t[i] = t;
+                adc_p[i] = base + i;
+                adc_h[i] = (base + i) & 0xFFFF;
+            }
+            check_samples( &handle, vector, CHECK_CHUNK, adc_t, adc_p, adc_h );
+        }
+    }
+}
+
+// データシート 8.2 の計算例
+static int check_datasheet_example( void )
+{
+    i2c_bme280_ioctl_param param;
+    i2c_bme280_env_raw raw = { 415148, 519888, 30000 };
+    i2c_bme280_env_compensated comp;
+    bme280_handle handle;
+
+    memset( &param, 0, sizeof(param) );
+    param.dig_t = sk_vectors[0].dig_t;
+    param.dig_p = sk_vectors[0].dig_p;
+    param.dig_h = sk_vectors[0].dig_h;
+    bme280_init( &handle, &param );
+    bme280_compensate_fixed( &handle, &raw, &comp );
+
+    if( comp.temperature != 2508 || comp.pressure != 25767233 ){
+        fprintf( stderr, "MISMATCH datasheet example: got %d/%u, expected 2508/25767233\n",
+                 comp.temperature, comp.pressure );
+        return -1;
+    }
+    return 0;
+}
+
+int main( int argc, char* argv[] )
+{
+    int failed = 0;
+    size_t v;
+    int check;
+
+    if( check_datasheet_example() != 0 ){
+        failed = 1;
+    }
+
+    for( v = 0; v < sizeof(sk_vectors) / sizeof(sk_vectors[0]); ++v ){
+        check_vector( &sk_vectors[v] );
+    }
+
+    for( check = 0; check < CHECK_NUM; ++check ){
+        check_result* result = &s_results[check];
+        if( result->checked == 0 ){
+            printf( "SKIP %-34s (not supported on this CPU)\n", result->name );
+            continue;
+        }
+        printf( "%s %-34s %llu samples, %llu mismatches\n",
+                result->mismatches == 0 ? "OK  " : "FAIL", result->name, result->checked, result->mismatches );
+        if( result->mismatches != 0 ){
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
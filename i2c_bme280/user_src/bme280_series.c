@@ -0,0 +1,489 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bme280_series.h"
+
+// 64bit値の可変長整数の最大バイト数
+#define VARINT_MAX_BYTES    10
+
+static inline uint64_t zigzag_encode( int64_t value )
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t zigzag_decode( uint64_t value )
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static inline uint8_t* varint_put( uint8_t* dst, uint64_t value )
+{
+    while( value >= 0x80 ){
+        *dst++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *dst++ = (uint8_t)value;
+    return dst;
+}
+
+// 失敗したら NULL
+static inline const uint8_t* varint_get( const uint8_t* src, const uint8_t* end, uint64_t* value )
+{
+    uint64_t result = 0;
+    int shift;
+
+    for( shift = 0; src < end && shift < 64; shift += 7 ){
+        uint8_t byte = *src++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if( (byte & 0x80) == 0 ){
+            *value = result;
+            return src;
+        }
+    }
+    return NULL;
+}
+
+static int write_all( int fd, const void* buf, size_t size )
+{
+    const uint8_t* p = buf;
+    ssize_t written;
+
+    while( size > 0 ){
+        written = write( fd, p, size );
+        if( written < 0 ){
+            if( errno == EINTR ){
+                continue;
+            }
+            return -1;
+        }
+        p += written;
+        size -= (size_t)written;
+    }
+    return 0;
+}
+
+static int file_header_valid( const bme280_series_file_header* header )
+{
+    return memcmp( header->magic, BME280_SERIES_MAGIC, sizeof(header->magic) ) == 0 &&
+           header->version == BME280_SERIES_VERSION && header->block_samples != 0;
+}
+
+// ブロックヘッダが正しければ列データのバイト数を返す。正しくなければ -1
+static int64_t block_payload_size( const bme280_series_block_header* header, uint32_t block_samples )
+{
+    int64_t payload = 0;
+    int c;
+
+    if( header->magic != BME280_SERIES_BLOCK_MAGIC || header->count == 0 || header->count > block_samples ){
+        return -1;
+    }
+    for( c = 0; c < BME280_SERIES_NCOLUMNS; ++c ){
+        payload += header->column_size[c];
+    }
+    return payload;
+}
+
+// 既存のファイルのヘッダを検証して block_samples を返す
+// 末尾に書きかけのブロックや壊れたデータがあれば、最後の完全なブロックの終わりまで切り詰める
+// そのまま追記すると、読み出し側はその手前で止まるので追記したブロックが読めなくなる
+static int64_t writer_recover( int fd, off_t size )
+{
+    bme280_series_file_header file_header;
+    bme280_series_block_header header;
+    off_t offset;
+    int64_t payload;
+
+    if( pread( fd, &file_header, sizeof(file_header), 0 ) != (ssize_t)sizeof(file_header) ||
+        !file_header_valid( &file_header ) ){
+        errno = EINVAL;
+        return -1;
+    }
+
+    offset = sizeof(file_header);
+    while( size - offset >= (off_t)sizeof(header) ){
+        if( pread( fd, &header, sizeof(header), offset ) != (ssize_t)sizeof(header) ){
+            return -1;
+        }
+        payload = block_payload_size( &header, file_header.block_samples );
+        if( payload < 0 || size - offset - (off_t)sizeof(header) < payload ){
+            break;
+        }
+        offset += sizeof(header) + payload;
+    }
+
+    if( offset != size && ftruncate( fd, offset ) != 0 ){
+        return -1;
+    }
+
+    return file_header.block_samples;
+}
+
+int bme280_series_writer_open( bme280_series_writer* writer, const char* path, uint32_t block_samples )
+{
+    bme280_series_file_header header;
+    struct stat st;
+    int64_t file_block_samples;
+    int i;
+
+    if( block_samples == 0 ){
+        block_samples = BME280_SERIES_DEFAULT_BLOCK_SAMPLES;
+    }
+
+    memset( writer, 0, sizeof(*writer) );
+    writer->fd = open( path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644 );
+    if( writer->fd < 0 ){
+        return -1;
+    }
+
+    if( fstat( writer->fd, &st ) != 0 ){
+        goto ERROR;
+    }
+    if( st.st_size != 0 ){
+        // 既存のファイルにはそのファイルの block_samples で追記する
+        file_block_samples = writer_recover( writer->fd, st.st_size );
+        if( file_block_samples < 0 ){
+            goto ERROR;
+        }
+        block_samples = (uint32_t)file_block_samples;
+        if( fstat( writer->fd, &st ) != 0 ){
+            goto ERROR;
+        }
+    }
+    writer->block_samples = block_samples;
+    writer->size = st.st_size;
+
+    writer->time = malloc( sizeof(uint64_t) * block_samples );
+    for( i = 0; i < 3; ++i ){
+        writer->value[i] = malloc( sizeof(int32_t) * block_samples );
+    }
+    writer->buffer = malloc( (size_t)VARINT_MAX_BYTES * BME280_SERIES_NCOLUMNS * block_samples );
+    if( writer->time == NULL || writer->value[0] == NULL || writer->value[1] == NULL ||
+        writer->value[2] == NULL || writer->buffer == NULL ){
+        errno = ENOMEM;
+        goto ERROR;
+    }
+
+    if( st.st_size == 0 ){
+        memset( &header, 0, sizeof(header) );
+        memcpy( header.magic, BME280_SERIES_MAGIC, sizeof(header.magic) );
+        header.version = BME280_SERIES_VERSION;
+        header.block_samples = block_samples;
+        if( write_all( writer->fd, &header, sizeof(header) ) != 0 ){
+            goto ERROR;
+        }
+        writer->size = sizeof(header);
+    }
+
+    return 0;
+
+ERROR:
+    {
+        int err = errno;
+        writer->count = 0;
+        bme280_series_writer_close( writer );
+        errno = err;
+    }
+    return -1;
+}
+
+int bme280_series_append( bme280_series_writer* writer, uint64_t timestamp, const i2c_bme280_env_raw* raw )
+{
+    uint32_t n;
+
+    // 前回の書き出しに失敗していれば、先に書き出して空きを作る
+    if( writer->count >= writer->block_samples && bme280_series_flush( writer ) != 0 ){
+        return -1;
+    }
+
+    n = writer->count;
+    writer->time[n] = timestamp;
+    writer->value[0][n] = raw->pressure;
+    writer->value[1][n] = raw->temperature;
+    writer->value[2][n] = raw->humidity;
+    writer->count = n + 1;
+
+    if( writer->count >= writer->block_samples ){
+        return bme280_series_flush( writer );
+    }
+    return 0;
+}
+
+int bme280_series_flush( bme280_series_writer* writer )
+{
+    bme280_series_block_header header;
+    uint8_t* p;
+    uint8_t* column;
+    uint32_t n = writer->count;
+    uint32_t i;
+    int c;
+    int err;
+
+    if( n == 0 ){
+        return 0;
+    }
+
+    memset( &header, 0, sizeof(header) );
+    header.magic = BME280_SERIES_BLOCK_MAGIC;
+    header.count = n;
+    header.first_time = writer->time[0];
+    header.last_time = writer->time[n - 1];
+
+    // 時刻: 差分の差分
+    p = writer->buffer;
+    {
+        uint64_t prev = writer->time[0];
+        int64_t prev_delta = 0;
+        int64_t delta;
+
+        for( i = 1; i < n; ++i ){
+            delta = (int64_t)(writer->time[i] - prev);
+            p = varint_put( p, zigzag_encode( delta - prev_delta ) );
+            prev = writer->time[i];
+            prev_delta = delta;
+        }
+    }
+    header.column_size[BME280_SERIES_TIME] = (uint32_t)(p - writer->buffer);
+
+    // 気圧, 気温, 湿度: 差分
+    for( c = 0; c < 3; ++c ){
+        const int32_t* value = writer->value[c];
+        int32_t prev = 0;
+        int32_t min = value[0];
+        int32_t max = value[0];
+
+        column = p;
+        for( i = 0; i < n; ++i ){
+            p = varint_put( p, zigzag_encode( (int64_t)value[i] - prev ) );
+            prev = value[i];
+            min = value[i] < min ? value[i] : min;
+            max = value[i] > max ? value[i] : max;
+        }
+        header.min[c] = min;
+        header.max[c] = max;
+        header.column_size[BME280_SERIES_PRESSURE + c] = (uint32_t)(p - column);
+    }
+
+    if( write_all( writer->fd, &header, sizeof(header) ) != 0 ||
+        write_all( writer->fd, writer->buffer, (size_t)(p - writer->buffer) ) != 0 ){
+        // 書きかけのブロックを残すと、その後ろに追記したブロックが読めなくなる
+        err = errno;
+        if( ftruncate( writer->fd, (off_t)writer->size ) != 0 ){
+            // 切り詰められなければ以降の追記も読めないので、書き込みを止める
+            close( writer->fd );
+            writer->fd = -1;
+        }
+        errno = err;
+        return -1;
+    }
+
+    writer->size += sizeof(header) + (uint64_t)(p - writer->buffer);
+    writer->count = 0;
+    return 0;
+}
+
+int bme280_series_writer_close( bme280_series_writer* writer )
+{
+    int result = 0;
+    int i;
+
+    if( writer->fd >= 0 ){
+        result = bme280_series_flush( writer );
+        if( close( writer->fd ) != 0 ){
+            result = -1;
+        }
+        writer->fd = -1;
+    }
+
+    free( writer->time );
+    for( i = 0; i < 3; ++i ){
+        free( writer->value[i] );
+    }
+    free( writer->buffer );
+
+    return result;
+}
+
+int bme280_series_reader_open( bme280_series_reader* reader, const char* path )
+{
+    bme280_series_file_header file_header;
+    bme280_series_block_header header;
+    struct stat st;
+    size_t offset;
+    int64_t payload;
+    uint32_t capacity = 0;
+    void* map;
+    int fd;
+
+    memset( reader, 0, sizeof(*reader) );
+
+    fd = open( path, O_RDONLY | O_CLOEXEC );
+    if( fd < 0 ){
+        return -1;
+    }
+    if( fstat( fd, &st ) != 0 ){
+        close( fd );
+        return -1;
+    }
+    if( (size_t)st.st_size < sizeof(file_header) ){
+        close( fd );
+        errno = EINVAL;
+        return -1;
+    }
+    map = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( map == MAP_FAILED ){
+        return -1;
+    }
+    reader->map = map;
+    reader->size = (size_t)st.st_size;
+
+    memcpy( &file_header, reader->map, sizeof(file_header) );
+    if( !file_header_valid( &file_header ) ){
+        errno = EINVAL;
+        goto ERROR;
+    }
+    reader->block_samples = file_header.block_samples;
+
+    // ブロックヘッダだけを辿って索引を作る。列データのページには触れない
+    offset = sizeof(file_header);
+    while( reader->size - offset >= sizeof(header) ){
+        memcpy( &header, reader->map + offset, sizeof(header) );
+        payload = block_payload_size( &header, reader->block_samples );
+        if( payload < 0 ){
+            break;
+        }
+        if( reader->size - offset - sizeof(header) < (uint64_t)payload ){
+            // 書きかけ
+            break;
+        }
+
+        if( reader->nblocks == capacity ){
+            uint32_t new_capacity = capacity ? capacity * 2 : 64;
+            void* headers = realloc( reader->headers, sizeof(*reader->headers) * new_capacity );
+            void* offsets;
+
+            if( headers == NULL ){
+                goto ERROR;
+            }
+            reader->headers = headers;
+            offsets = realloc( reader->offsets, sizeof(*reader->offsets) * new_capacity );
+            if( offsets == NULL ){
+                goto ERROR;
+            }
+            reader->offsets = offsets;
+            capacity = new_capacity;
+        }
+        reader->headers[reader->nblocks] = header;
+        reader->offsets[reader->nblocks] = offset + sizeof(header);
+        reader->nblocks++;
+
+        offset += sizeof(header) + payload;
+    }
+
+    return 0;
+
+ERROR:
+    {
+        int err = errno;
+        bme280_series_reader_close( reader );
+        errno = err;
+    }
+    return -1;
+}
+
+void bme280_series_reader_close( bme280_series_reader* reader )
+{
+    if( reader->map != NULL ){
+        munmap( (void*)reader->map, reader->size );
+    }
+    free( reader->headers );
+    free( reader->offsets );
+    memset( reader, 0, sizeof(*reader) );
+}
+
+uint32_t bme280_series_find( const bme280_series_reader* reader, uint64_t time )
+{
+    uint32_t lo = 0;
+    uint32_t hi = reader->nblocks;
+    uint32_t mid;
+
+    while( lo < hi ){
+        mid = lo + (hi - lo) / 2;
+        if( reader->headers[mid].last_time < time ){
+            lo = mid + 1;
+        }else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int bme280_series_decode( const bme280_series_reader* reader, uint32_t block, unsigned int columns,
+                          uint64_t* time, int32_t* pressure, int32_t* temperature, int32_t* humidity )
+{
+    const bme280_series_block_header* header;
+    int32_t* values[3] = { pressure, temperature, humidity };
+    const uint8_t* column;
+    const uint8_t* p;
+    const uint8_t* end;
+    uint64_t raw;
+    uint32_t n;
+    uint32_t i;
+    int c;
+
+    if( block >= reader->nblocks ){
+        errno = EINVAL;
+        return -1;
+    }
+    header = &(reader->headers[block]);
+    n = header->count;
+    column = reader->map + reader->offsets[block];
+
+    for( c = 0; c < BME280_SERIES_NCOLUMNS; ++c ){
+        p = column;
+        end = column + header->column_size[c];
+        column = end;
+        if( (columns & BME280_SERIES_COLUMN(c)) == 0 ){
+            continue;
+        }
+
+        if( c == BME280_SERIES_TIME ){
+            uint64_t prev = header->first_time;
+            int64_t delta = 0;
+
+            time[0] = prev;
+            for( i = 1; i < n; ++i ){
+                p = varint_get( p, end, &raw );
+                if( p == NULL ){
+                    goto CORRUPTED;
+                }
+                delta += zigzag_decode( raw );
+                prev += (uint64_t)delta;
+                time[i] = prev;
+            }
+        }else{
+            int32_t* value = values[c - BME280_SERIES_PRESSURE];
+            int32_t prev = 0;
+
+            for( i = 0; i < n; ++i ){
+                p = varint_get( p, end, &raw );
+                if( p == NULL ){
+                    goto CORRUPTED;
+                }
+                prev = (int32_t)(prev + zigzag_decode( raw ));
+                value[i] = prev;
+            }
+        }
+    }
+
+    return (int)n;
+
+CORRUPTED:
+    errno = EINVAL;
+    return -1;
+}
@@ -0,0 +1,112 @@
+#ifndef BME280_SERIES_H_INCLUDED
+#define BME280_SERIES_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+// my driver header file
+#include "../i2c_bme280.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 未補正の生値を長期保存するための時系列ファイル形式
+//
+//  ファイルヘッダ  bme280_series_file_header
+//  ブロック        bme280_series_block_header + 列データ(時刻, 気圧, 気温, 湿度の順)
+//  ブロック        ...
+//
+// 1ブロックには最大 block_samples 件のサンプルを列毎にまとめて格納する
+// 各列は直前の値との差分を zig-zag 符号化した可変長整数(LEB128)で並べる
+// 時刻列だけは周期的に測定していれば差分がほぼ一定になるので、差分の差分を格納する
+// ブロックヘッダには時刻の範囲と各列の最小/最大値を持たせ、列データを展開せずに範囲検索できるようにしている
+// 値はすべてホストのバイトオーダ。1ファイルには1デバイス分のサンプルを時刻順に格納すること
+
+#define BME280_SERIES_MAGIC                 "BME280TS"
+#define BME280_SERIES_VERSION               1
+#define BME280_SERIES_BLOCK_MAGIC           0x4b4c4250      // "PBLK"
+#define BME280_SERIES_DEFAULT_BLOCK_SAMPLES 4096
+
+// 列の番号
+enum
+{
+    BME280_SERIES_TIME = 0,
+    BME280_SERIES_PRESSURE,
+    BME280_SERIES_TEMPERATURE,
+    BME280_SERIES_HUMIDITY,
+    BME280_SERIES_NCOLUMNS
+};
+#define BME280_SERIES_COLUMN(c) (1u << (c))
+#define BME280_SERIES_ALL       ((1u << BME280_SERIES_NCOLUMNS) - 1)
+
+typedef struct bme280_series_file_header_t
+{
+    char     magic[8];          // BME280_SERIES_MAGIC
+    uint32_t version;           // BME280_SERIES_VERSION
+    uint32_t block_samples;     // 1ブロックの最大サンプル数
+} bme280_series_file_header;
+
+typedef struct bme280_series_block_header_t
+{
+    uint32_t magic;             // BME280_SERIES_BLOCK_MAGIC
+    uint32_t count;             // サンプル数
+    uint64_t first_time;        // 最初のサンプルの時刻 [ns]
+    uint64_t last_time;         // 最後のサンプルの時刻 [ns]
+    int32_t  min[3];            // 気圧, 気温, 湿度の最小値
+    int32_t  max[3];            // 気圧, 気温, 湿度の最大値
+    uint32_t column_size[BME280_SERIES_NCOLUMNS];   // 各列のバイト数
+} bme280_series_block_header;
+
+// 書き込み側。サンプルをブロック単位で溜めてからファイルに追記する
+typedef struct bme280_series_writer_t
+{
+    int       fd;
+    uint32_t  block_samples;
+    uint32_t  count;
+    uint64_t  size;             // 書き込みが完了したブロックの終わりの位置
+    uint64_t* time;
+    int32_t*  value[3];         // 気圧, 気温, 湿度
+    uint8_t*  buffer;           // 符号化用
+} bme280_series_writer;
+
+// path を開いて追記する。ファイルが空ならファイルヘッダを書く
+// block_samples が 0 なら BME280_SERIES_DEFAULT_BLOCK_SAMPLES
+// 既存のファイルならヘッダを検証してファイルの block_samples を使い、末尾の書きかけのブロックは切り詰める
+int bme280_series_writer_open( bme280_series_writer* writer, const char* path, uint32_t block_samples );
+// ブロックが一杯なら書き出す。書き出しに失敗したサンプルは残しておき、次の append か flush で再度書き出す
+// 前回の書き出しに失敗したままブロックが一杯なら、サンプルを追加せずに -1 を返す
+int bme280_series_append( bme280_series_writer* writer, uint64_t timestamp, const i2c_bme280_env_raw* raw );
+// 溜まっているサンプルをブロックとして書き出す
+// 書き込みに失敗したら、書きかけのブロックを切り詰めてから -1 を返す
+int bme280_series_flush( bme280_series_writer* writer );
+// flush してから閉じる
+int bme280_series_writer_close( bme280_series_writer* writer );
+
+// 読み出し側。ファイルを mmap し、開いた時点ではブロックヘッダだけを読む
+// 列データは bme280_series_decode() で指定した列だけを展開する
+typedef struct bme280_series_reader_t
+{
+    const uint8_t*              map;
+    size_t                      size;
+    uint32_t                    block_samples;
+    uint32_t                    nblocks;
+    bme280_series_block_header* headers;
+    size_t*                     offsets;    // 各ブロックの列データの位置
+} bme280_series_reader;
+
+// 末尾の書きかけのブロックは無視する
+int bme280_series_reader_open( bme280_series_reader* reader, const char* path );
+void bme280_series_reader_close( bme280_series_reader* reader );
+// time 以降のサンプルを含む最初のブロックの番号。無ければ nblocks
+uint32_t bme280_series_find( const bme280_series_reader* reader, uint64_t time );
+// block を展開する。columns(BME280_SERIES_COLUMN の論理和)で指定した列だけを展開し、指定しない列の出力先は NULL でよい
+// 出力先はそれぞれ block_samples 件分の大きさが必要。戻り値はサンプル数、壊れていれば -1
+int bme280_series_decode( const bme280_series_reader* reader, uint32_t block, unsigned int columns,
+                          uint64_t* time, int32_t* pressure, int32_t* temperature, int32_t* humidity );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif      // BME280_SERIES_H_INCLUDED
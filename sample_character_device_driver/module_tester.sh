@@ -1,8 +1,28 @@
 #!/bin/bash
 
-insmod sample_character_device_driver.ko
+insmod sample_character_device_driver.ko nbanks=2
 echo "HOGEE" > /dev/pseudo-eep-mem0
 echo "HELLO" > /dev/pseudo-eep-mem0
 dd if=/dev/pseudo-eep-mem0 of=test.img bs=100 count=11
 hexdump -C test.img
+echo "BANK1" > /dev/pseudo-eep-mem1
+dd if=/dev/pseudo-eep-mem1 of=test.img bs=100 count=1
+hexdump -C test.img
+rmmod sample_character_device_driver
+
+# バッキングファイルに書き戻した内容が再ロード後も残っていること
+insmod sample_character_device_driver.ko backing_file=/tmp/pseudo-eep-mem.img
+echo "PERSIST" > /dev/pseudo-eep-mem0
+rmmod sample_character_device_driver
+insmod sample_character_device_driver.ko backing_file=/tmp/pseudo-eep-mem.img
+dd if=/dev/pseudo-eep-mem0 of=test.img bs=16 count=1
+hexdump -C test.img
+rmmod sample_character_device_driver
+
+# EEPROM エミュレーション。ページ境界をまたぐ書き込みは2サイクル分かかる
+insmod sample_character_device_driver.ko emulate=1 write_cycle_us=5000
+time dd if=/dev/zero of=/dev/pseudo-eep-mem0 bs=32 count=64
+time dd if=/dev/zero of=/dev/pseudo-eep-mem0 bs=32 count=64 seek=1 oflag=seek_bytes
+grep . /sys/class/pseudo-eep-class/pseudo-eep-mem0/wear/*
+head /sys/kernel/debug/pseudo-eep-mem/pseudo-eep-mem0/wear
 rmmod sample_character_device_driver
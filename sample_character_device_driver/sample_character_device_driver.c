@@ -5,7 +5,19 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
 #include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/bitmap.h>
+#include <linux/workqueue.h>
+#include <linux/delay.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/moduleparam.h>
 #include <asm/current.h>
 #include <asm/uaccess.h>
 
@@ -18,8 +30,14 @@
 
 // Minor number using this device driver
 static const unsigned int MINOR_BASE = 0;
-// Minor number counts using this device driver
-static const unsigned int EEP_NBANK  = 1;
+// Max minor number counts using this device driver
+#define EEP_MAX_NBANK   256
+// バッキングファイルへ一度に書き出す最大サイズ [byte]
+#define EEP_FLUSH_CHUNK (64 * 1024)
+// page_size の上限 [byte]。write() はページ単位の作業バッファを確保する
+#define EEP_MAX_PAGE_SIZE   (64 * 1024)
+// read() で一度にロックを取って読み出す最大サイズ [byte]。EEP_MAX_PAGE_SIZE の倍数であること
+#define EEP_READ_CHUNK      (64 * 1024)
 
 //
 // declare static functions, structs
@@ -28,32 +46,122 @@ static int pseudo_eep_mem_open(struct inode *inode, struct file *file);
 static int pseudo_eep_mem_close(struct inode *inode, struct file *file);
 static ssize_t pseudo_eep_mem_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
 static ssize_t pseudo_eep_mem_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
-
+static loff_t pseudo_eep_mem_llseek(struct file *filp, loff_t offset, int whence);
+static int pseudo_eep_mem_mmap(struct file *filp, struct vm_area_struct *vma);
+static int pseudo_eep_mem_fsync(struct file *filp, loff_t start, loff_t end, int datasync);
+static void pseudo_eep_mem_vm_open( struct vm_area_struct* vma );
+static void pseudo_eep_mem_vm_close( struct vm_area_struct* vma );
+
+// バンク毎のメモリ領域。バンク毎に1つのマイナー番号(/dev/pseudo-eep-mem<N>)を割り当てる
+// open() で filp->private_data に設定し、以降のファイル操作はこれを使う
 typedef struct
 {
-    u8* memory;
+    u8* memory;         // mmap() できるよう vmalloc_user で確保する
     u32 size;
+    // 読み出しは並行して行い、書き込みはページ単位で排他する
+    // バンク毎に独立しているので、別のバンクへのアクセスは互いに待たない
+    struct rw_semaphore lock;
+    struct cdev cdev;
+    dev_t devt;
+    unsigned int index;
+    // バッキングファイルへ未反映のページ。page_size 単位で1ビット
+    // 書き込みは lock を write で、フラッシュは lock を read で取った上で s_flush_lock で排他して操作する
+    unsigned long* dirty;
+    unsigned int npages;
+    // 書き込み可能な(mprotect() で後から書き込み可能にできるものを含む) mmap() の数と、
+    // そのマップが外されてからまだ書き戻していないこと
+    // マップ経由の書き込みは追跡できないので、どちらかがあればフラッシュ時は全ページを書き出す
+    atomic_t writable_maps;
+    bool writable_unmapped;
+
+    // write() によるページ書き込みの統計。lock を write で取って更新する
+    // mmap() 経由の書き込みは数えない
+    u64 page_writes;            // 書き込みサイクル数(書き込んだページ数)
+    u64 bytes_written;
+    u64 partial_page_writes;    // ページの一部だけを書き換えたサイクル数
+    u64 cross_page_writes;      // ページ境界をまたいだ write() の数
+    // ページ毎の消去/書き込み回数。emulate 時のみ確保する
+    u32* page_cycles;
+    u32 max_page_cycles;
+    struct dentry* debugfs;
 } pseudo_eep_mem_area;
 
+static int pseudo_eep_mem_create_bank( pseudo_eep_mem_area* bank, unsigned int index );
+static void pseudo_eep_mem_remove_bank( pseudo_eep_mem_area* bank );
+static int pseudo_eep_mem_load_bank( pseudo_eep_mem_area* bank );
+static int pseudo_eep_mem_flush_bank( pseudo_eep_mem_area* bank );
+static void pseudo_eep_mem_flush_work( struct work_struct* work );
+static void pseudo_eep_mem_write_cycle( pseudo_eep_mem_area* bank, loff_t pos, size_t count );
+
 // 
 // define static variables
 //
 static struct class *s_pseudo_eep_class = NULL;
-static struct cdev  s_pseudo_eep_cdev;
 static dev_t s_alloced_dev_region;
+static pseudo_eep_mem_area* s_pseudo_eepmem_banks = NULL;   // nbanks 個の配列
+static struct file* s_backing_filp = NULL;
+static DEFINE_MUTEX(s_flush_lock);                          // フラッシュ同士の排他
+static DECLARE_DELAYED_WORK(s_flush_dwork, pseudo_eep_mem_flush_work);
+static struct dentry* s_pseudo_eep_debugfs_root = NULL;
 
 struct file_operations s_pseudo_eepmem_fops = {
     .open    = pseudo_eep_mem_open,
     .release = pseudo_eep_mem_close,
     .read    = pseudo_eep_mem_read,
     .write   = pseudo_eep_mem_write,
+    .llseek  = pseudo_eep_mem_llseek,
+    .mmap    = pseudo_eep_mem_mmap,
+    .fsync   = pseudo_eep_mem_fsync,
 };
 
-static pseudo_eep_mem_area s_pseudo_eepmem = { 
-    NULL,               // Need dynamic allocation when load this module
-    1024 * 8,           // 8KB
+static const struct vm_operations_struct s_pseudo_eepmem_vm_ops = {
+    .open  = pseudo_eep_mem_vm_open,
+    .close = pseudo_eep_mem_vm_close,
 };
 
+// バンク数。/dev/pseudo-eep-mem0 から順にバンク毎のデバイスノードを作る
+static unsigned int nbanks = 1;
+module_param( nbanks, uint, 0444 );
+MODULE_PARM_DESC( nbanks, "number of banks (1 - 256)" );
+
+// 1バンクあたりのサイズ [byte]
+// vmalloc で確保するので物理的に連続している必要はなく、数百MBでも確保できる
+static unsigned int bank_size = 1024 * 8;
+module_param( bank_size, uint, 0444 );
+MODULE_PARM_DESC( bank_size, "size of each bank in bytes" );
+
+// 書き込みのページサイズ [byte]
+// 実際のEEPROMのページ書き込みと同じく、1ページ内の書き込みは途中の状態を読まれることがない
+// ページをまたぐ書き込みはページ毎に分けて反映する。2のべき乗で EEP_MAX_PAGE_SIZE 以下であること
+static unsigned int page_size = 32;
+module_param( page_size, uint, 0444 );
+MODULE_PARM_DESC( page_size, "write page size in bytes (power of 2, up to 65536)" );
+
+// バッキングファイルのパス。指定するとロード時に内容を読み込み、書き込まれたページを書き戻す
+// バンク N の内容はファイルの N * bank_size バイト目から置く
+static char* backing_file = NULL;
+module_param( backing_file, charp, 0444 );
+MODULE_PARM_DESC( backing_file, "path of the file to load from and write back to (optional)" );
+
+// write() からバッキングファイルへ書き戻すまでの遅延 [ms]
+// この間の書き込みはまとめて書き戻す。fsync() とアンロード時は待たずに書き戻す
+static unsigned int flush_delay_ms = 1000;
+module_param( flush_delay_ms, uint, 0644 );
+MODULE_PARM_DESC( flush_delay_ms, "delay before writing dirty pages back to backing_file in ms" );
+
+// EEPROM のエミュレーション
+// 有効にすると write() はページ毎に write_cycle_us だけ待ち、ページ毎の書き込み回数を数える
+// 実際のEEPROMと同じく、書き込むバイト数にかかわらず触れたページの数だけ時間がかかるので
+// ページ境界をまたぐ書き込みや、ページの一部だけの書き込みを繰り返すと遅くなる
+static bool emulate = false;
+module_param( emulate, bool, 0444 );
+MODULE_PARM_DESC( emulate, "emulate EEPROM write cycle time and per-page wear" );
+
+// 1ページの書き込みサイクル時間 [us] (tWR)。emulate 時のみ有効
+static unsigned int write_cycle_us = 5000;
+module_param( write_cycle_us, uint, 0644 );
+MODULE_PARM_DESC( write_cycle_us, "write cycle time per page in us when emulate is set" );
+
 static size_t calculate_remain_count( size_t max_size, size_t count, loff_t pos )
 {
     size_t remain_count = 0;
@@ -71,146 +179,637 @@ static size_t calculate_remain_count( size_t max_size, size_t count, loff_t pos
 // open時に呼ばれる関数
 static int pseudo_eep_mem_open(struct inode *inode, struct file *file)
 {
-    pr_info( "%s", __func__ );
+    pr_debug( "%s", __func__ );
+
+    // open したマイナー番号のバンク
+    file->private_data = container_of( inode->i_cdev, pseudo_eep_mem_area, cdev );
     return 0;
 }
 
 // close時に呼ばれる関数
 static int pseudo_eep_mem_close(struct inode *inode, struct file *file)
 {
-    pr_info( "%s", __func__ );
+    pr_debug( "%s", __func__ );
     return 0;
 }
 
 // read時に呼ばれる関数
+// EEP_READ_CHUNK 単位に分け、排他して作業バッファへ取り出してからユーザー空間へコピーする
+// 区切りはページ境界に揃うので、各ページは書き込み途中の状態を含まない
+// ページをまたいで読んだ場合は、ページ毎に別の write() の前後の状態が混ざることがある
 static ssize_t pseudo_eep_mem_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
 {
-    pr_info( "%s", __func__ );
-
-    size_t read_count = calculate_remain_count( s_pseudo_eepmem.size, count, *f_pos );
+    pseudo_eep_mem_area* bank = filp->private_data;
+    size_t read_count;
+    u8* chunk_buf;
+    size_t copied = 0;
+    ssize_t result = 0;
+    pr_debug( "%s", __func__ );
+
+    read_count = calculate_remain_count( bank->size, count, *f_pos );
     if( read_count == 0 ){
         return 0;
     }
 
-    u8* eepmem_read_start = s_pseudo_eepmem.memory + *f_pos;
-    if( copy_to_user( buf, eepmem_read_start, read_count ) != 0 ){
-        return -EIO;
+    // ロックを取ったままユーザー空間のページフォルトを待たないよう、一旦ここにコピーする
+    chunk_buf = kvmalloc( min_t(size_t, read_count, EEP_READ_CHUNK), GFP_KERNEL );
+    if( chunk_buf == NULL ){
+        return -ENOMEM;
     }
 
-    *f_pos += read_count;
+    while( copied < read_count ){
+        loff_t pos = *f_pos + copied;
+        // 次の EEP_READ_CHUNK 境界まで
+        size_t chunk = min_t(size_t, read_count - copied, EEP_READ_CHUNK - (pos & (EEP_READ_CHUNK - 1)));
+
+        down_read( &bank->lock );
+        memcpy( chunk_buf, bank->memory + pos, chunk );
+        up_read( &bank->lock );
 
-    return read_count;
+        if( copy_to_user( buf + copied, chunk_buf, chunk ) != 0 ){
+            result = -EFAULT;
+            break;
+        }
+
+        copied += chunk;
+    }
+
+    kvfree( chunk_buf );
+
+    // 途中で失敗した場合は、そこまでに読み出せた分を返す
+    if( copied == 0 ){
+        return result;
+    }
+
+    *f_pos += copied;
+
+    return copied;
 }
 
 // write時に呼ばれる関数
+// page_size 単位に分け、ユーザー空間からのコピーを済ませてからページ毎に排他して反映する
 static ssize_t pseudo_eep_mem_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
 {
-    pr_info( "%s", __func__ );
-
-    size_t write_count = calculate_remain_count( s_pseudo_eepmem.size, count, *f_pos );
+    pseudo_eep_mem_area* bank = filp->private_data;
+    size_t write_count;
+    u8* page_buf;
+    size_t written = 0;
+    ssize_t result = 0;
+    pr_debug( "%s", __func__ );
+
+    write_count = calculate_remain_count( bank->size, count, *f_pos );
     if( write_count == 0 ){
         return 0;
     }
 
-    u8* eepmem_write_start = s_pseudo_eepmem.memory + *f_pos;
-    if( copy_from_user( eepmem_write_start, buf, write_count ) != 0 ){
-        return -EIO;
+    // ロックを取ったままユーザー空間のページフォルトを待たないよう、一旦ここにコピーする
+    page_buf = kvmalloc( page_size, GFP_KERNEL );
+    if( page_buf == NULL ){
+        return -ENOMEM;
+    }
+
+    while( written < write_count ){
+        loff_t pos = *f_pos + written;
+        // 次のページ境界まで
+        size_t chunk = min_t(size_t, write_count - written, page_size - (pos & (page_size - 1)));
+
+        // 書き込みサイクルを待つと大きな書き込みには時間がかかるので、ページ毎にシグナルを確認する
+        if( signal_pending( current ) ){
+            result = -ERESTARTSYS;
+            break;
+        }
+
+        if( copy_from_user( page_buf, buf + written, chunk ) != 0 ){
+            result = -EFAULT;
+            break;
+        }
+
+        down_write( &bank->lock );
+        memcpy( bank->memory + pos, page_buf, chunk );
+        if( bank->dirty ){
+            __set_bit( (size_t)pos / page_size, bank->dirty );
+        }
+        pseudo_eep_mem_write_cycle( bank, pos, chunk );
+        // 2ページ目を書き込んだところで、ページ境界をまたいだ書き込みとして1回数える
+        if( written != 0 && written == page_size - (*f_pos & (page_size - 1)) ){
+            bank->cross_page_writes++;
+        }
+        up_write( &bank->lock );
+
+        written += chunk;
+    }
+
+    kvfree( page_buf );
+
+    // 途中のページで失敗したりシグナルで中断した場合は、そこまでに書き込めた分を返す
+    if( written == 0 ){
+        return result;
+    }
+
+    *f_pos += written;
+
+    // 書き戻しはワークキューで後からまとめて行う。既に予約済みなら何もしない
+    if( bank->dirty ){
+        schedule_delayed_work( &s_flush_dwork, msecs_to_jiffies( flush_delay_ms ) );
     }
 
-    *f_pos += write_count;
+    return written;
+}
+
+// 1ページ分の書き込みサイクル。bank->lock を write で取って呼ぶこと
+// 実際のEEPROMは書き込みサイクル中にアクセスできないので、ロックを持ったまま待つ
+static void pseudo_eep_mem_write_cycle( pseudo_eep_mem_area* bank, loff_t pos, size_t count )
+{
+    u32* cycles;
+    unsigned int cycle_us;
+
+    bank->page_writes++;
+    bank->bytes_written += count;
+    if( count != page_size ){
+        bank->partial_page_writes++;
+    }
 
-    return write_count;
+    if( !bank->page_cycles ){
+        return;
+    }
+
+    cycles = &bank->page_cycles[(size_t)pos / page_size];
+    if( *cycles != U32_MAX ){
+        (*cycles)++;
+    }
+    bank->max_page_cycles = max( bank->max_page_cycles, *cycles );
+
+    cycle_us = READ_ONCE( write_cycle_us );
+    if( cycle_us != 0 ){
+        usleep_range( cycle_us, cycle_us + cycle_us / 8 + 1 );
+    }
 }
 
-static int __init pseudo_eep_mem_init(void)
+// lseek時に呼ばれる関数
+// SEEK_SET/SEEK_CUR/SEEK_END に対応し、位置は [0, size] に制限する
+static loff_t pseudo_eep_mem_llseek(struct file *filp, loff_t offset, int whence)
+{
+    pseudo_eep_mem_area* bank = filp->private_data;
+
+    return fixed_size_llseek( filp, offset, whence, bank->size );
+}
+
+// mmap時に呼ばれる関数
+// メモリ領域をそのままユーザー空間にマップする。MAP_SHARED のみ対応
+// PROT_WRITE で書き込み可能にマップするには書き込み可能で open しておくこと
+// マップした領域への書き込みは write() のページ単位の排他を経由しないので、
+// 書き込み中の状態を read() や他のプロセスから読まれることがある
+// バッキングファイルへは msync()/fsync() か munmap() の後で書き戻す
+static int pseudo_eep_mem_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    pseudo_eep_mem_area* bank = filp->private_data;
+    int result;
+    pr_debug( "%s", __func__ );
+
+    if( !(vma->vm_flags & VM_SHARED) ){
+        return -EINVAL;
+    }
+
+    // マップ範囲がメモリ領域からはみ出していれば失敗する
+    result = remap_vmalloc_range( vma, bank->memory, vma->vm_pgoff );
+    if( result != 0 ){
+        return result;
+    }
+
+    vma->vm_private_data = bank;
+    vma->vm_ops = &s_pseudo_eepmem_vm_ops;
+    pseudo_eep_mem_vm_open( vma );
+
+    return 0;
+}
+
+// マップを作った時と、fork() や部分的な munmap()/mprotect() でマップが複製/分割された時に呼ばれる関数
+// PROT_READ でマップしても、書き込み可能で open していれば後から mprotect() で書き込み可能にできる
+// その場合も追跡できるよう、VM_WRITE ではなく VM_MAYWRITE を見る
+static void pseudo_eep_mem_vm_open( struct vm_area_struct* vma )
+{
+    pseudo_eep_mem_area* bank = vma->vm_private_data;
+
+    if( vma->vm_flags & VM_MAYWRITE ){
+        atomic_inc( &bank->writable_maps );
+    }
+}
+
+// マップを外した時に呼ばれる関数
+// マップ経由の書き込みは write() と違って書き戻しを予約しないので、ここで予約する
+static void pseudo_eep_mem_vm_close( struct vm_area_struct* vma )
+{
+    pseudo_eep_mem_area* bank = vma->vm_private_data;
+
+    if( !(vma->vm_flags & VM_MAYWRITE) ){
+        return;
+    }
+
+    // フラッシュ側が writable_maps == 0 を見た時には、必ず writable_unmapped も見えるよう先に立てる
+    WRITE_ONCE( bank->writable_unmapped, true );
+    smp_mb__before_atomic();
+    atomic_dec( &bank->writable_maps );
+
+    if( bank->dirty ){
+        schedule_delayed_work( &s_flush_dwork, msecs_to_jiffies( flush_delay_ms ) );
+    }
+}
+
+// fsync時に呼ばれる関数。msync() からも呼ばれる
+// このバンクの未反映のページをバッキングファイルに書き戻してから、ファイルを同期する
+static int pseudo_eep_mem_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+    pseudo_eep_mem_area* bank = filp->private_data;
+    int result;
+
+    if( !s_backing_filp ){
+        return 0;
+    }
+
+    result = pseudo_eep_mem_flush_bank( bank );
+    if( result != 0 ){
+        return result;
+    }
+
+    return vfs_fsync( s_backing_filp, datasync );
+}
+
+// バッキングファイルからバンクの内容を読み込む
+// ファイルが短ければ、足りない分はゼロのまま
+static int pseudo_eep_mem_load_bank( pseudo_eep_mem_area* bank )
+{
+    loff_t pos = (loff_t)bank->index * bank_size;
+    size_t loaded = 0;
+    ssize_t result;
+
+    while( loaded < bank->size ){
+        result = kernel_read( s_backing_filp, bank->memory + loaded, bank->size - loaded, &pos );
+        if( result < 0 ){
+            pr_err( "%s failed. kernel_read = %zd, bank = %u\n", __func__, result, bank->index );
+            return result;
+        }
+        if( result == 0 ){
+            break;
+        }
+        loaded += result;
+    }
+
+    return 0;
+}
+
+// バンクの未反映のページをバッキングファイルに書き戻す
+// 連続した未反映ページを EEP_FLUSH_CHUNK までまとめて取り出し、ロックを外してから書き込む
+// 書き込み中も write() は待たされない
+static int pseudo_eep_mem_flush_bank( pseudo_eep_mem_area* bank )
+{
+    unsigned int chunk_pages = max_t(unsigned int, EEP_FLUSH_CHUNK / page_size, 1);
+    unsigned int first = 0;
+    unsigned int last;
+    size_t offset;
+    size_t len;
+    loff_t pos;
+    ssize_t written;
+    int result = 0;
+
+    u8* buf = kvmalloc( (size_t)chunk_pages * page_size, GFP_KERNEL );
+    if( !buf ){
+        return -ENOMEM;
+    }
+
+    mutex_lock( &s_flush_lock );
+    for( ;; ){
+        down_read( &bank->lock );
+        if( first == 0 && (atomic_read( &bank->writable_maps ) != 0 || xchg( &bank->writable_unmapped, false )) ){
+            bitmap_fill( bank->dirty, bank->npages );
+        }
+        first = find_next_bit( bank->dirty, bank->npages, first );
+        if( first >= bank->npages ){
+            up_read( &bank->lock );
+            break;
+        }
+        last = find_next_zero_bit( bank->dirty, bank->npages, first );
+        last = min( last, first + chunk_pages );
+
+        // 最後のページは bank_size で切れていることがある
+        offset = (size_t)first * page_size;
+        len = min_t(size_t, (size_t)last * page_size, bank->size) - offset;
+        memcpy( buf, bank->memory + offset, len );
+        bitmap_clear( bank->dirty, first, last - first );
+        up_read( &bank->lock );
+
+        pos = (loff_t)bank->index * bank_size + offset;
+        written = kernel_write( s_backing_filp, buf, len, &pos );
+        if( written != len ){
+            // 書き戻せなかったページは次の機会に再度書き戻す
+            down_read( &bank->lock );
+            bitmap_set( bank->dirty, first, last - first );
+            up_read( &bank->lock );
+            result = (written < 0) ? written : -EIO;
+            pr_err_ratelimited( "%s failed. kernel_write = %zd, bank = %u\n", __func__, written, bank->index );
+            break;
+        }
+
+        first = last;
+    }
+    mutex_unlock( &s_flush_lock );
+
+    kvfree( buf );
+    return result;
+}
+
+// write() から遅延して実行される書き戻し
+static void pseudo_eep_mem_flush_work( struct work_struct* work )
+{
+    unsigned int i;
+
+    for( i = 0; i < nbanks; i++ ){
+        pseudo_eep_mem_flush_bank( &s_pseudo_eepmem_banks[i] );
+    }
+}
+
+// 書き込みの統計。/sys/class/pseudo-eep-class/pseudo-eep-mem<N>/wear/ 以下に見える
+// ページ毎の書き込み回数は debugfs の wear で読む
+#define PSEUDO_EEP_MEM_WEAR_ATTR( _name )                                                                   \
+static ssize_t _name##_show( struct device *dev, struct device_attribute *attr, char *buf )                 \
+{                                                                                                           \
+    pseudo_eep_mem_area* bank = dev_get_drvdata( dev );                                                     \
+    u64 value;                                                                                              \
+    down_read( &bank->lock );                                                                               \
+    value = bank->_name;                                                                                    \
+    up_read( &bank->lock );                                                                                 \
+    return sprintf( buf, "%llu\n", value );                                                                 \
+}                                                                                                           \
+static DEVICE_ATTR_RO( _name )
+
+PSEUDO_EEP_MEM_WEAR_ATTR( page_writes );
+PSEUDO_EEP_MEM_WEAR_ATTR( bytes_written );
+PSEUDO_EEP_MEM_WEAR_ATTR( partial_page_writes );
+PSEUDO_EEP_MEM_WEAR_ATTR( cross_page_writes );
+PSEUDO_EEP_MEM_WEAR_ATTR( max_page_cycles );
+
+static struct attribute* pseudo_eep_mem_wear_attrs[] = {
+    &dev_attr_page_writes.attr,
+    &dev_attr_bytes_written.attr,
+    &dev_attr_partial_page_writes.attr,
+    &dev_attr_cross_page_writes.attr,
+    &dev_attr_max_page_cycles.attr,
+    NULL,
+};
+
+static const struct attribute_group pseudo_eep_mem_wear_group = {
+    .name  = "wear",
+    .attrs = pseudo_eep_mem_wear_attrs,
+};
+static const struct attribute_group* pseudo_eep_mem_groups[] = {
+    &pseudo_eep_mem_wear_group,
+    NULL,
+};
+
+// "<ページ番号> <書き込み回数>" の形式で、回数が 0 のページは省略する
+static int pseudo_eep_mem_wear_show( struct seq_file* s, void* unused )
+{
+    pseudo_eep_mem_area* bank = s->private;
+    unsigned int npages = DIV_ROUND_UP( bank->size, page_size );
+    unsigned int page;
+
+    down_read( &bank->lock );
+    for( page = 0; page < npages; ++page ){
+        if( bank->page_cycles[page] != 0 ){
+            seq_printf( s, "%u %u\n", page, bank->page_cycles[page] );
+        }
+    }
+    up_read( &bank->lock );
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE( pseudo_eep_mem_wear );
+
+// バンクを1つ作成してデバイスノードを作る
+static int pseudo_eep_mem_create_bank( pseudo_eep_mem_area* bank, unsigned int index )
 {
-    dev_t curr_dev;
     int result = 0;
     struct device *created_dev = NULL;
-    pr_info( "pseudo eep mem device driver initialization.\n" );
 
-    // 空いているメジャー番号を確保
-    result = alloc_chrdev_region( &s_alloced_dev_region, MINOR_BASE, EEP_NBANK, EEP_DEVICE_NAME );
-    if( result < 0 ){
-        pr_err( "%s failed. alloc_chrdev_region = %d\n", __func__, result );
-        goto REGION_ERR;
+    // ニセeeprom用メモリ領域確保
+    // デバイスノードを作った時点で open される可能性があるので、先に確保しておく
+    // vmalloc_user はページ単位で確保してゼロクリアし、ユーザー空間へのマップを許可する
+    bank->size = bank_size;
+    bank->index = index;
+    bank->memory = vmalloc_user( bank->size );
+    if( !bank->memory ){
+        pr_err( "%s failed. pseudo_eep_memory area allocation. bank = %u\n", __func__, index );
+        return -ENOMEM;
+    }
+    init_rwsem( &bank->lock );
+
+    if( emulate ){
+        bank->page_cycles = vzalloc( DIV_ROUND_UP( bank->size, page_size ) * sizeof(u32) );
+        if( !bank->page_cycles ){
+            pr_err( "%s failed. page_cycles allocation. bank = %u\n", __func__, index );
+            result = -ENOMEM;
+            goto BITMAP_ALLOC_ERR;
+        }
     }
 
-    // デバイスクラス登録  /sys/class に見えるようになる
-    s_pseudo_eep_class = class_create( THIS_MODULE, EEP_CLASS );
-    if( IS_ERR(s_pseudo_eep_class) ){
-        result = PTR_ERR(s_pseudo_eep_class);
-        pr_err( "%s failed. class_create = %d\n", __func__, result );
-        goto CREATE_CLASS_ERR;
+    if( s_backing_filp ){
+        bank->npages = DIV_ROUND_UP( bank->size, page_size );
+        // page_size が小さいと大きなバンクでは数MBになるので、連続した物理メモリを要求しない
+        bank->dirty = kvcalloc( BITS_TO_LONGS( bank->npages ), sizeof(unsigned long), GFP_KERNEL );
+        if( !bank->dirty ){
+            pr_err( "%s failed. dirty bitmap allocation. bank = %u\n", __func__, index );
+            result = -ENOMEM;
+            goto BITMAP_ALLOC_ERR;
+        }
+        result = pseudo_eep_mem_load_bank( bank );
+        if( result != 0 ){
+            goto LOAD_ERR;
+        }
     }
 
     // ファイル操作関数をバインド
-    cdev_init( &s_pseudo_eep_cdev, &s_pseudo_eepmem_fops );
-    s_pseudo_eep_cdev.owner = THIS_MODULE;
+    cdev_init( &bank->cdev, &s_pseudo_eepmem_fops );
+    bank->cdev.owner = THIS_MODULE;
     // デバイス番号を生成
-    curr_dev = MKDEV(MAJOR(s_alloced_dev_region), MINOR(s_alloced_dev_region));
+    bank->devt = MKDEV(MAJOR(s_alloced_dev_region), MINOR(s_alloced_dev_region) + index);
     // このデバイスドライバをカーネルに登録する
-    result = cdev_add(&s_pseudo_eep_cdev, curr_dev, 1 );
+    result = cdev_add( &bank->cdev, bank->devt, 1 );
     if( result != 0 ){
-        pr_err( "%s failed. cdev_add = %d\n", __func__, result );
+        pr_err( "%s failed. cdev_add = %d, bank = %u\n", __func__, result, index );
         goto CDEV_ADD_ERR;
     }
 
     // デバイスノードを作成。作成したノードは/dev以下からアクセス可能
-    created_dev = device_create( 
+    created_dev = device_create_with_groups( 
             s_pseudo_eep_class,
             NULL,               // no parent device
-            curr_dev,
-            NULL,               // no additional data
+            bank->devt,
+            bank,
+            pseudo_eep_mem_groups,
             EEP_DEVICE_NAME "%d",
-            MINOR_BASE );       // pseudo-eep-mem0
+            MINOR_BASE + index );   // pseudo-eep-mem0, pseudo-eep-mem1, ...
 
     if( IS_ERR(created_dev) ){
         result = PTR_ERR(created_dev);
-        pr_err( "%s failed. device_create = %d\n", __func__, result );
+        pr_err( "%s failed. device_create = %d, bank = %u\n", __func__, result, index );
         goto DEV_CREATE_ERR;
     }
 
-    // ニセeeprom用メモリ領域確保
-    s_pseudo_eepmem.memory = kzalloc( s_pseudo_eepmem.size, GFP_KERNEL );
-    if( !s_pseudo_eepmem.memory ){
-        pr_err( "%s failed. pseudo_eep_memory area allocation.", __func__ );
-        goto PSEUDO_EEP_MEM_ALLOC_ERR;
+    // debugfs はデバッグ用なので作成に失敗してもロードは失敗させない
+    if( bank->page_cycles ){
+        bank->debugfs = debugfs_create_dir( dev_name( created_dev ), s_pseudo_eep_debugfs_root );
+        debugfs_create_file( "wear", 0444, bank->debugfs, bank, &pseudo_eep_mem_wear_fops );
     }
 
-    pr_info( "%s succeeded", __func__ );
-
-    // initialize succeeded
     return 0;
 
     // error bailout
-PSEUDO_EEP_MEM_ALLOC_ERR:
 DEV_CREATE_ERR:
-    cdev_del( &s_pseudo_eep_cdev );
+    cdev_del( &bank->cdev );
 CDEV_ADD_ERR:
+LOAD_ERR:
+    kvfree( bank->dirty );
+    bank->dirty = NULL;
+BITMAP_ALLOC_ERR:
+    vfree( bank->page_cycles );
+    bank->page_cycles = NULL;
+    vfree( bank->memory );
+    bank->memory = NULL;
+    return result;
+}
+
+// pseudo_eep_mem_create_bank で作成したバンクを削除する
+static void pseudo_eep_mem_remove_bank( pseudo_eep_mem_area* bank )
+{
+    debugfs_remove_recursive( bank->debugfs );
+    bank->debugfs = NULL;
+    // デバイスノード削除
+    device_destroy( s_pseudo_eep_class, bank->devt );
+    // キャラクターデバイスをKernelから削除
+    cdev_del( &bank->cdev );
+    // ニセeepmem領域開放
+    kvfree( bank->dirty );
+    bank->dirty = NULL;
+    vfree( bank->page_cycles );
+    bank->page_cycles = NULL;
+    vfree( bank->memory );
+    bank->memory = NULL;
+}
+
+static int __init pseudo_eep_mem_init(void)
+{
+    int result = 0;
+    unsigned int i;
+    pr_info( "pseudo eep mem device driver initialization.\n" );
+
+    if( nbanks == 0 || nbanks > EEP_MAX_NBANK ){
+        pr_err( "%s failed. invalid nbanks = %u\n", __func__, nbanks );
+        return -EINVAL;
+    }
+    if( bank_size == 0 ){
+        pr_err( "%s failed. invalid bank_size = %u\n", __func__, bank_size );
+        return -EINVAL;
+    }
+    if( !is_power_of_2( page_size ) || page_size > bank_size || page_size > EEP_MAX_PAGE_SIZE ){
+        pr_err( "%s failed. invalid page_size = %u\n", __func__, page_size );
+        return -EINVAL;
+    }
+
+    s_pseudo_eepmem_banks = kcalloc( nbanks, sizeof(pseudo_eep_mem_area), GFP_KERNEL );
+    if( !s_pseudo_eepmem_banks ){
+        pr_err( "%s failed. bank array allocation.", __func__ );
+        return -ENOMEM;
+    }
+
+    if( backing_file && backing_file[0] != '\0' ){
+        s_backing_filp = filp_open( backing_file, O_RDWR | O_CREAT | O_LARGEFILE, 0600 );
+        if( IS_ERR(s_backing_filp) ){
+            result = PTR_ERR(s_backing_filp);
+            s_backing_filp = NULL;
+            pr_err( "%s failed. filp_open(%s) = %d\n", __func__, backing_file, result );
+            goto BACKING_FILE_ERR;
+        }
+    }
+
+    // 空いているメジャー番号を確保。バンクの数だけマイナー番号を使う
+    result = alloc_chrdev_region( &s_alloced_dev_region, MINOR_BASE, nbanks, EEP_DEVICE_NAME );
+    if( result < 0 ){
+        pr_err( "%s failed. alloc_chrdev_region = %d\n", __func__, result );
+        goto REGION_ERR;
+    }
+
+    // デバイスクラス登録  /sys/class に見えるようになる
+    s_pseudo_eep_class = class_create( THIS_MODULE, EEP_CLASS );
+    if( IS_ERR(s_pseudo_eep_class) ){
+        result = PTR_ERR(s_pseudo_eep_class);
+        pr_err( "%s failed. class_create = %d\n", __func__, result );
+        goto CREATE_CLASS_ERR;
+    }
+
+    // バンク毎のページ書き込み回数を置く debugfs ディレクトリ
+    if( emulate ){
+        s_pseudo_eep_debugfs_root = debugfs_create_dir( EEP_DEVICE_NAME, NULL );
+    }
+
+    for( i = 0; i < nbanks; i++ ){
+        result = pseudo_eep_mem_create_bank( &s_pseudo_eepmem_banks[i], i );
+        if( result != 0 ){
+            goto CREATE_BANK_ERR;
+        }
+    }
+
+    pr_info( "%s succeeded. %u banks x %u bytes", __func__, nbanks, bank_size );
+
+    // initialize succeeded
+    return 0;
+
+    // error bailout
+CREATE_BANK_ERR:
+    // 作成済みのバンクだけ削除する
+    while( i-- > 0 ){
+        pseudo_eep_mem_remove_bank( &s_pseudo_eepmem_banks[i] );
+    }
+    debugfs_remove_recursive( s_pseudo_eep_debugfs_root );
+    s_pseudo_eep_debugfs_root = NULL;
     class_destroy( s_pseudo_eep_class );
 CREATE_CLASS_ERR:
-    unregister_chrdev_region( s_alloced_dev_region, EEP_NBANK );
+    unregister_chrdev_region( s_alloced_dev_region, nbanks );
 REGION_ERR:
-    return -1;
+    if( s_backing_filp ){
+        filp_close( s_backing_filp, NULL );
+        s_backing_filp = NULL;
+    }
+BACKING_FILE_ERR:
+    kfree( s_pseudo_eepmem_banks );
+    s_pseudo_eepmem_banks = NULL;
+    return result;
 }
 
 static void __exit pseudo_eep_mem_exit(void)
 {
+    unsigned int i;
+
     pr_info( "pseudo eep mem device driver exit.\n" );
 
-    dev_t dev = MKDEV(MAJOR(s_alloced_dev_region), MINOR(s_alloced_dev_region));
+    // アンロード中は open できないので、ここで書き戻せば以降の書き込みは無い
+    if( s_backing_filp ){
+        cancel_delayed_work_sync( &s_flush_dwork );
+        for( i = 0; i < nbanks; i++ ){
+            pseudo_eep_mem_flush_bank( &s_pseudo_eepmem_banks[i] );
+        }
+        vfs_fsync( s_backing_filp, 0 );
+        filp_close( s_backing_filp, NULL );
+        s_backing_filp = NULL;
+    }
 
-    // デバイスノード削除
-    device_destroy( s_pseudo_eep_class, dev );
-    // キャラクターデバイスをKernelから削除
-    cdev_del( &s_pseudo_eep_cdev );
+    for( i = 0; i < nbanks; i++ ){
+        pseudo_eep_mem_remove_bank( &s_pseudo_eepmem_banks[i] );
+    }
+    debugfs_remove_recursive( s_pseudo_eep_debugfs_root );
     // デバイスのクラス登録を削除
     class_destroy( s_pseudo_eep_class );
     // デバイスが使用していたメジャー番号の登録削除
-    unregister_chrdev_region( dev, EEP_NBANK );
-    // ニセeepmem領域開放
-    kfree( s_pseudo_eepmem.memory );
+    unregister_chrdev_region( s_alloced_dev_region, nbanks );
+    kfree( s_pseudo_eepmem_banks );
 }
 
 module_init(pseudo_eep_mem_init);